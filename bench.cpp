@@ -0,0 +1,385 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Graeme Hattan                                   *
+ *   graemeh.dev@googlemail.com                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+/**
+ * Benchmarks of the tracker on synthetic footage (see SyntheticFootage) - the classifier
+ * kernels, labeling, region resolution and picking the largest regions on their own, the
+ * image loading and .mat writing, and the whole tracking end to end in frames/s - so changes
+ * are measured rather than guessed. Run with 'make bench'.
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+
+#include <unistd.h>
+
+#include "imageloader.h"
+#include "matfiledump.h"
+#include "regionlabeler.h"
+#include "spotclassifier.h"
+#include "spottracker.h"
+#include "synthframes.h"
+
+using namespace std;
+using namespace cv;
+
+typedef SpotClassifier::MaskWord MaskWord;
+
+
+// the tracker's default thresholds and spot count
+static const SpotThresholds thresholds = { 210, 5, 10 };
+static const int num_spots = 4;
+
+static const int default_field_count = 500;
+
+// times over each image for the stages too quick to time once
+static const int select_repeats = 100;
+static const int mat_columns_per_image = 100;
+
+
+static double seconds_since(int64 start)
+{
+  return (getTickCount() - start) / getTickFrequency();
+}
+
+
+static void report(const string &name, double value, const char *unit)
+{
+  cout << "  " << left << setw(30) << name << right << fixed << setprecision(3) << setw(12) << value << ' ' << unit << endl;
+}
+
+
+static bool highest_point(const Point2d &p1, const Point2d &p2) { return p1.y < p2.y; }
+
+
+/** Classify every row of the fields with each kernel the CPU supports, the masks are kept for the labeling */
+static void bench_classify(const vector<Mat> &fields, vector< vector<MaskWord> > &masks)
+{
+  cout << "Classifier" << endl;
+
+  SpotColourTable table(thresholds);
+
+  vector<SpotClassifier> classifiers;
+  classifiers.push_back( SpotClassifier(thresholds, SpotClassifier::KERNEL_SCALAR) );
+  classifiers.push_back( SpotClassifier(thresholds, SpotClassifier::KERNEL_SSSE3) );
+  classifiers.push_back( SpotClassifier(thresholds, SpotClassifier::KERNEL_AVX2) );
+  classifiers.push_back( SpotClassifier(table, SpotClassifier::KERNEL_TABLE) );
+  classifiers.push_back( SpotClassifier(table, SpotClassifier::KERNEL_TABLE_AVX2) );
+
+  SpotClassifier::Kernel requested[] = { SpotClassifier::KERNEL_SCALAR, SpotClassifier::KERNEL_SSSE3, SpotClassifier::KERNEL_AVX2,
+                                         SpotClassifier::KERNEL_TABLE, SpotClassifier::KERNEL_TABLE_AVX2 };
+
+  int words = SpotClassifier::mask_words(fields[0].cols);
+  double pixels = (double)fields.size() * fields[0].rows * fields[0].cols;
+
+  masks.assign( fields.size(), vector<MaskWord>(fields[0].rows * words) );
+
+  for( size_t kernel=0; kernel < classifiers.size(); ++kernel )
+  {
+    const SpotClassifier &classifier = classifiers[kernel];
+
+    // the fallbacks are the same as another kernel, don't time them twice
+    if( classifier.kernel_type() != requested[kernel] )
+      continue;
+
+    int64 start = getTickCount();
+
+    for( size_t index=0; index < fields.size(); ++index )
+    {
+      const Mat &field = fields[index];
+      for( int row=0; row < field.rows; ++row )
+        classifier.classify_row(field.ptr(row), field.cols, &masks[index][row * words]);
+    }
+
+    report( string("classify ") + classifier.kernel_name(), seconds_since(start) * 1e9 / pixels, "ns/pixel" );
+  }
+
+  // the table kernels differ from the thresholds on a few colours, label what the tracker would
+  SpotClassifier classifier(thresholds);
+  for( size_t index=0; index < fields.size(); ++index )
+    for( int row=0; row < fields[index].rows; ++row )
+      classifier.classify_row(fields[index].ptr(row), fields[index].cols, &masks[index][row * words]);
+}
+
+
+/** Label the classified fields, resolve the regions and pick the largest */
+static void bench_labeling(const vector<Mat> &fields, const vector< vector<MaskWord> > &masks)
+{
+  cout << "Labeling" << endl;
+
+  int rows = fields[0].rows;
+  int cols = fields[0].cols;
+  int words = SpotClassifier::mask_words(cols);
+
+  RunLabeler labeler;
+  double label_seconds = 0;
+  double resolve_seconds = 0;
+
+  vector< vector<Region> > regions(fields.size());
+  size_t region_total = 0;
+
+  for( size_t index=0; index < fields.size(); ++index )
+  {
+    int64 start = getTickCount();
+
+    labeler.reset();
+    for( int row=0; row < rows; ++row )
+      labeler.add_row(row, &masks[index][row * words], cols);
+
+    int64 labelled = getTickCount();
+    labeler.resolve(regions[index]);
+
+    label_seconds += (labelled - start) / getTickFrequency();
+    resolve_seconds += seconds_since(labelled);
+
+    region_total += regions[index].size();
+  }
+
+  vector<const Region *> largest(num_spots);
+  Region empty_region;
+
+  int64 start = getTickCount();
+
+  for( int repeat=0; repeat < select_repeats; ++repeat )
+    for( size_t index=0; index < fields.size(); ++index )
+      largest_regions(regions[index], largest, &empty_region);
+
+  double select_seconds = seconds_since(start) / select_repeats;
+
+  report( "label", label_seconds * 1e6 / fields.size(), "us/image" );
+  report( "resolve", resolve_seconds * 1e6 / fields.size(), "us/image" );
+  report( "select largest", select_seconds * 1e9 / fields.size(), "ns/image" );
+  report( "regions", (double)region_total / fields.size(), "per image" );
+}
+
+
+/** Load every image of the ppm files and the stream */
+static void bench_load(const string &ppm_dir, const string &y4m_name, int field_count)
+{
+  cout << "Loading" << endl;
+
+  Mat image;
+
+  {
+    ImageLoader loader(ppm_dir, true);
+
+    int64 start = getTickCount();
+    for( int field_num=0; field_num < field_count; ++field_num )
+      loader.load_image(field_num, image);
+
+    report( "load ppm", seconds_since(start) * 1e3 / field_count, "ms/image" );
+  }
+
+  ImageLoader loader(y4m_name, true);
+  int stream_count = loader.image_count();
+
+  int64 start = getTickCount();
+  for( int field_num=0; field_num < stream_count; ++field_num )
+    loader.load_image(field_num, image);
+
+  report( "load y4m to BGR", seconds_since(start) * 1e3 / stream_count, "ms/image" );
+
+  Mat y, cb, cr;
+  start = getTickCount();
+  for( int field_num=0; field_num < stream_count; ++field_num )
+    loader.load_planes(field_num, y, cb, cr);
+
+  report( "load y4m planes", seconds_since(start) * 1e6 / stream_count, "us/image" );
+}
+
+
+/** Write the .mat output for many images, as the tracker does */
+static void bench_matfile(const string &dir, int field_count)
+{
+  cout << "Output" << endl;
+
+  string name = dir + "bench_tracking.mat";
+  int columns = field_count * mat_columns_per_image;
+  double column[6] = { 250.5, 120.25, 260.75, 210.5, 270.125, 280.0 };
+
+  int64 start = getTickCount();
+
+  {
+    MatFileDump outfile;
+    outfile.newFile(6, name, 0);
+    outfile.addVariable("region_counts", 1);
+    outfile.addVariable("warnings", 1);
+    outfile.addVariable("image_numbers", 1);
+
+    for( int index=0; index < columns; ++index )
+    {
+      outfile.writeColumn(0, column);
+      outfile.writeDouble(1, 4);
+      outfile.writeDouble(2, 0);
+      outfile.writeDouble(3, index);
+    }
+
+    outfile.finaliseAndClose();
+  }
+
+  report( "write .mat", seconds_since(start) * 1e9 / columns, "ns/image" );
+
+  unlink( name.c_str() );
+}
+
+
+/** Track all the images as the batch mode does on one thread, and check the spots against where they really are */
+static void bench_tracking(const string &name, const char *mode, const vector< vector<Point2d> > &truth,
+                           bool chroma_planes, bool windowed, int pyramid_factor, const string &dir)
+{
+  ImageLoader loader(name, true);
+  int image_count = min( loader.image_count(), (int)truth.size() );
+
+  SpotTracker tracker(num_spots, thresholds, chroma_planes);
+  tracker.set_windowed(windowed);
+  tracker.set_pyramid_factor(pyramid_factor);
+
+  string mat_name = dir + "bench_tracking.mat";
+  MatFileDump outfile(6, mat_name, image_count);
+
+  TrackFrame frame;
+  Mat no_display_mask;
+  vector<Point2d> track_points;
+
+  int found_all = 0;
+  double error_total = 0;
+  double error_max = 0;
+
+  int64 start = getTickCount();
+
+  for( int file_num=0; file_num < image_count; ++file_num )
+  {
+    loader.load_frame(file_num, chroma_planes, frame);
+
+    int distinct_region_count = tracker.track(file_num, frame, no_display_mask, track_points);
+    sort( track_points.begin(), track_points.end(), highest_point );
+
+    Point2d leg_centre = (track_points[0] + track_points[1]) * 0.5;
+    double column[6] = { leg_centre.x, leg_centre.y, track_points[2].x, track_points[2].y, track_points[3].x, track_points[3].y };
+    outfile.writeColumn(0, column);
+
+    if( distinct_region_count >= num_spots )
+    {
+      ++found_all;
+
+      for( int index=0; index < num_spots; ++index )
+      {
+        Point2d error = track_points[index] - truth[file_num][index];
+        double distance = sqrt(error.x*error.x + error.y*error.y);
+
+        error_total += distance;
+        error_max = max(error_max, distance);
+      }
+    }
+  }
+
+  outfile.finaliseAndClose();
+  double seconds = seconds_since(start);
+
+  unlink( mat_name.c_str() );
+
+  cout << "  " << left << setw(30) << mode << right << fixed << setprecision(1) << setw(12) << image_count / seconds << " frames/s, "
+       << found_all << '/' << image_count << " with all the spots, error " << setprecision(2)
+       << error_total / max(found_all * num_spots, 1) << " px mean " << error_max << " px max" << endl;
+}
+
+
+static void usage(const char *prog)
+{
+  cerr << "Usage: " << prog << " [-n fields] [-N noise] [-c clutter] [-S] [-r seed] [-d dir] [-o dir]" << endl
+       << "  -n  fields of footage to benchmark with (default " << default_field_count << ')' << endl
+       << "  -N  standard deviation of the noise added to each channel (default " << SyntheticFootage::default_settings().noise << ')' << endl
+       << "  -c  shapes of clutter in the background (default " << SyntheticFootage::default_settings().clutter << ')' << endl
+       << "  -S  no shadows" << endl
+       << "  -r  random seed for the clutter and noise" << endl
+       << "  -d  directory for the scratch files (default /tmp)" << endl
+       << "  -o  just write the footage to this directory as ppm files, e.g. to run runbot_tracking on" << endl;
+}
+
+
+int main( int argc, char** argv )
+{
+  SyntheticFootage::Settings settings = SyntheticFootage::default_settings();
+  int field_count = default_field_count;
+  string scratch = "/tmp";
+  string write_dir;
+
+  int opt;
+  while( (opt = getopt(argc, argv, "c:d:hn:N:o:r:S")) != -1 )
+  {
+    switch(opt)
+    {
+      case 'c': settings.clutter = max( atoi(optarg), 0 ); break;
+      case 'd': scratch = optarg; break;
+      case 'n': field_count = max( atoi(optarg), 2 ); break;
+      case 'N': settings.noise = max( atof(optarg), 0.0 ); break;
+      case 'o': write_dir = optarg; break;
+      case 'r': settings.seed = atoi(optarg); break;
+      case 'S': settings.shadows = false; break;
+
+      case 'h':
+        usage(argv[0]);
+        return 0;
+
+      default:
+        usage(argv[0]);
+        return -1;
+    }
+  }
+
+  SyntheticFootage footage(settings);
+
+  if( !write_dir.empty() )
+    return footage.write_ppm(write_dir, field_count) ? 0 : -1;
+
+  vector<Mat> fields(field_count);
+  vector< vector<Point2d> > truth(field_count);
+
+  for( int field_num=0; field_num < field_count; ++field_num )
+    footage.render(field_num, fields[field_num], truth[field_num]);
+
+  cout << "Synthetic footage: " << field_count << ' ' << settings.size.width << 'x' << settings.size.height << " fields, noise "
+       << settings.noise << ", " << settings.clutter << " clutter, " << (settings.shadows ? "shadows" : "no shadows") << endl;
+
+  vector< vector<MaskWord> > masks;
+  bench_classify(fields, masks);
+  bench_labeling(fields, masks);
+
+  // the loading and the end to end tracking read the footage back from files
+  string dir = make_scratch_dir(scratch, "runbot_bench");
+  if( dir.empty() )
+    return -1;
+
+  string y4m_name = dir + "bench.y4m";
+
+  if( !footage.write_ppm(dir, field_count) || !footage.write_y4m(y4m_name, field_count) )
+  {
+    remove_scratch_dir(dir);
+    return -1;
+  }
+
+  bench_load(dir, y4m_name, field_count);
+  bench_matfile(dir, field_count);
+
+  cout << "Tracking end to end (one thread)" << endl;
+  bench_tracking(dir, "full scan", truth, false, false, 1, dir);
+  bench_tracking(dir, "windowed (-w)", truth, false, true, 1, dir);
+  bench_tracking(dir, "windowed, coarse (-w -p 4)", truth, false, true, 4, dir);
+  bench_tracking(y4m_name, "y4m chroma planes (-c -w)", truth, true, true, 1, dir);
+
+  remove_scratch_dir(dir);
+
+  return 0;
+}
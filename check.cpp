@@ -0,0 +1,603 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Graeme Hattan                                   *
+ *   graemeh.dev@googlemail.com                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+/**
+ * Checks every way the tracker can find the spots against the reference tracker (per-pixel
+ * labeling into true connected components, see ReferenceTracker) - each classifier kernel, the
+ * run labeling, the parallel strips, the windowed and coarse to fine searches and the chroma
+ * planes. They are run over synthetic footage (see SyntheticFootage) and any recordings given,
+ * and every image where the spots' centres or the region count differ from the reference is
+ * reported. The original labeling (see LegacyTracker) is compared too, but as it split some
+ * shapes its differences are expected and only listed. Run with 'make check'.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "imageloader.h"
+#include "matfiledump.h"
+#include "referencetracker.h"
+#include "spotclassifier.h"
+#include "spottracker.h"
+#include "synthframes.h"
+
+using namespace std;
+using namespace cv;
+
+
+// the tracker's defaults
+static const SpotThresholds default_thresholds = { 210, 5, 10 };
+static const int default_track_regions = 4;
+
+static const int default_field_count = 200;
+
+// largest difference between centres counted as the same (the centres are exact averages, so
+// this only allows for rounding)
+static const double default_tolerance = 1e-6;
+
+// differing images printed for each engine and sequence, unless -v
+static const int max_reported = 10;
+
+// threads for each batch mode run of runbot_tracking, they must all match tracking the images
+// one after another
+static const int batch_threads[] = { 1, 4, 4 };
+
+// runbot_tracking's batch_chunk - with -w the windows start again every this many images
+static const int batch_chunk = 64;
+
+
+/** A way of tracking to check, and how it has done so far on a sequence */
+struct Engine
+{
+  string name;
+  SpotTracker *tracker;
+  bool chroma_planes;   // tracks the Y/Cb/Cr planes rather than the BGR image
+  bool table;           // compared with the reference using the colour table
+  bool whole_image;     // labels the whole image every time, so finds every region the reference does
+
+  int images;
+  int count_mismatches;
+  int centre_mismatches;
+  double max_difference;
+};
+
+
+/** Options for the check, from the command line */
+struct CheckOptions
+{
+  int num_spots;
+  SpotThresholds thresholds;
+  SpotColourTable table;
+  bool fields;
+  double tolerance;
+  bool verbose;
+};
+
+
+/** NaN (a spot not found) after all the spots that were */
+static bool highest_point(const Point2d &p1, const Point2d &p2)
+{
+  if( std::isnan(p1.y) || std::isnan(p2.y) )
+    return !std::isnan(p1.y) && std::isnan(p2.y);
+
+  return p1.y < p2.y;
+}
+
+
+/** Largest distance between matching centres, sorted by their y-values - infinite if only one of them found a spot */
+static double centre_difference(vector<Point2d> points, vector<Point2d> reference)
+{
+  sort( points.begin(), points.end(), highest_point );
+  sort( reference.begin(), reference.end(), highest_point );
+
+  double difference = 0;
+
+  for( size_t index=0; index < reference.size(); ++index )
+  {
+    bool found = !std::isnan(points[index].x);
+    bool reference_found = !std::isnan(reference[index].x);
+
+    if( found != reference_found )
+      return INFINITY;
+
+    if( found )
+    {
+      Point2d error = points[index] - reference[index];
+      difference = max( difference, sqrt(error.x*error.x + error.y*error.y) );
+    }
+  }
+
+  return difference;
+}
+
+
+/**
+ * Count and print an image where an engine differs from the reference, returns whether it
+ * differed
+ */
+static bool compare(Engine &engine, int file_num, int count, int expected_count, double difference,
+                    const CheckOptions &options)
+{
+  // the windowed and coarse searches only count the regions they look at, so just check
+  // they found the spots when the reference did
+  bool count_mismatch = engine.whole_image ? count != expected_count
+                                           : min(count, options.num_spots) != min(expected_count, options.num_spots);
+  bool centre_mismatch = difference > options.tolerance;
+
+  ++engine.images;
+
+  if( count_mismatch )
+    ++engine.count_mismatches;
+
+  if( centre_mismatch )
+  {
+    ++engine.centre_mismatches;
+    engine.max_difference = max(engine.max_difference, difference);
+  }
+
+  if( (count_mismatch || centre_mismatch)
+      && (options.verbose || engine.count_mismatches + engine.centre_mismatches <= max_reported) )
+  {
+    cout << "  " << left << setw(28) << engine.name << " image " << file_num << ": " << count << " regions (reference "
+         << expected_count << "), centres differ by " << fixed << setprecision(3) << difference << " px" << endl;
+  }
+
+  return count_mismatch || centre_mismatch;
+}
+
+
+/** Print an engine's line of the summary, marked if it differed */
+static void print_engine(const Engine &engine, const char *marker)
+{
+  cout << "  " << left << setw(28) << engine.name << right << setw(8) << engine.images << setw(18) << engine.count_mismatches
+       << setw(18) << engine.centre_mismatches << setw(13) << fixed << setprecision(3) << engine.max_difference << " px"
+       << (engine.count_mismatches + engine.centre_mismatches > 0 ? marker : "") << endl;
+}
+
+
+/** Add a tracker to check if the classifier got the kernel asked for */
+static void add_engine(vector<Engine> &engines, const string &name, const SpotClassifier &classifier,
+                       SpotClassifier::Kernel requested, const CheckOptions &options,
+                       bool chroma_planes=false, bool windowed=false, int pyramid_factor=1, int strips=1)
+{
+  if( classifier.kernel_type() != requested )
+  {
+    cout << "  " << left << setw(28) << name << " not supported on this CPU, skipped" << endl;
+    return;
+  }
+
+  Engine engine;
+  engine.name = name;
+  engine.tracker = new SpotTracker(options.num_spots, classifier, chroma_planes);
+  engine.tracker->set_windowed(windowed);
+  engine.tracker->set_pyramid_factor(pyramid_factor);
+  engine.tracker->set_strips(strips);
+  engine.chroma_planes = chroma_planes;
+  engine.table = requested == SpotClassifier::KERNEL_TABLE || requested == SpotClassifier::KERNEL_TABLE_AVX2;
+  engine.whole_image = !windowed && pyramid_factor == 1;
+  engine.images = 0;
+  engine.count_mismatches = 0;
+  engine.centre_mismatches = 0;
+  engine.max_difference = 0;
+
+  engines.push_back(engine);
+}
+
+
+/**
+ * Track a sequence with every engine and the reference, returns the number of images any
+ * engine differed on or -1 if the sequence couldn't be read
+ */
+static int check_sequence(const string &path, bool chroma_planes, const CheckOptions &options)
+{
+  ImageLoader loader(path, options.fields);
+
+  int image_count = loader.image_count();
+  if( image_count <= 0 )
+  {
+    cerr << "Error: No images found in " << path << endl;
+    return -1;
+  }
+
+  chroma_planes = chroma_planes && loader.has_chroma_planes();
+
+  cout << path << ": " << image_count << " images" << endl;
+
+  SpotClassifier classifier(options.thresholds);
+  SpotClassifier table_classifier(options.table);
+
+  vector<Engine> engines;
+  add_engine( engines, "scalar", SpotClassifier(options.thresholds, SpotClassifier::KERNEL_SCALAR), SpotClassifier::KERNEL_SCALAR, options );
+  add_engine( engines, "ssse3", SpotClassifier(options.thresholds, SpotClassifier::KERNEL_SSSE3), SpotClassifier::KERNEL_SSSE3, options );
+  add_engine( engines, "avx2", SpotClassifier(options.thresholds, SpotClassifier::KERNEL_AVX2), SpotClassifier::KERNEL_AVX2, options );
+  add_engine( engines, "table", SpotClassifier(options.table, SpotClassifier::KERNEL_TABLE), SpotClassifier::KERNEL_TABLE, options );
+  add_engine( engines, "table avx2", SpotClassifier(options.table, SpotClassifier::KERNEL_TABLE_AVX2), SpotClassifier::KERNEL_TABLE_AVX2, options );
+  add_engine( engines, "strips (-s 4)", classifier, classifier.kernel_type(), options, false, false, 1, 4 );
+  add_engine( engines, "windowed (-w)", classifier, classifier.kernel_type(), options, false, true );
+  add_engine( engines, "coarse (-p 2)", classifier, classifier.kernel_type(), options, false, false, 2 );
+  add_engine( engines, "coarse (-p 4)", classifier, classifier.kernel_type(), options, false, false, 4 );
+  add_engine( engines, "windowed coarse (-w -p 4)", classifier, classifier.kernel_type(), options, false, true, 4 );
+  add_engine( engines, "windowed table (-L -w)", table_classifier, table_classifier.kernel_type(), options, false, true );
+
+  if( chroma_planes )
+  {
+    add_engine( engines, "chroma (-c)", classifier, classifier.kernel_type(), options, true );
+    add_engine( engines, "chroma strips (-c -s 4)", classifier, classifier.kernel_type(), options, true, false, 1, 4 );
+    add_engine( engines, "chroma windowed (-c -w -p 4)", classifier, classifier.kernel_type(), options, true, true, 4 );
+  }
+
+  // the references, with the thresholds and with the colour table
+  ReferenceTracker reference(options.num_spots, SpotClassifier(options.thresholds, SpotClassifier::KERNEL_SCALAR));
+  ReferenceTracker table_reference(options.num_spots, SpotClassifier(options.table, SpotClassifier::KERNEL_TABLE));
+
+  // the original labeling, only to show where the output has changed from it
+  LegacyTracker legacy_tracker(options.num_spots, SpotClassifier(options.thresholds, SpotClassifier::KERNEL_SCALAR));
+
+  Engine legacy;
+  legacy.name = "legacy (original labeling)";
+  legacy.tracker = NULL;
+  legacy.chroma_planes = false;
+  legacy.table = false;
+  legacy.whole_image = true;
+  legacy.images = 0;
+  legacy.count_mismatches = 0;
+  legacy.centre_mismatches = 0;
+  legacy.max_difference = 0;
+
+  TrackFrame frame;
+  TrackFrame planes;
+  Mat no_display_mask;
+
+  vector<Point2d> reference_points, table_reference_points, track_points;
+  int differing_images = 0;
+
+  for( int file_num=0; file_num < image_count; ++file_num )
+  {
+    loader.load_image(file_num, frame.bgr);
+    if( chroma_planes )
+      loader.load_planes(file_num, planes.y, planes.cb, planes.cr);
+
+    int reference_count = reference.track(frame.bgr, reference_points);
+    int table_reference_count = table_reference.track(frame.bgr, table_reference_points);
+
+    bool differs = false;
+
+    for( size_t index=0; index < engines.size(); ++index )
+    {
+      Engine &engine = engines[index];
+
+      int count = engine.tracker->track(file_num, engine.chroma_planes ? planes : frame, no_display_mask, track_points);
+
+      int expected_count = engine.table ? table_reference_count : reference_count;
+      double difference = centre_difference(track_points, engine.table ? table_reference_points : reference_points);
+
+      if( compare(engine, file_num, count, expected_count, difference, options) )
+        differs = true;
+    }
+
+    // known differences, not counted
+    int legacy_count = legacy_tracker.track(frame.bgr, track_points);
+    compare(legacy, file_num, legacy_count, reference_count, centre_difference(track_points, reference_points), options);
+
+    if( differs )
+      ++differing_images;
+  }
+
+  cout << "  " << left << setw(28) << "engine" << right << setw(8) << "images" << setw(18) << "count mismatches"
+       << setw(18) << "centre mismatches" << setw(16) << "max difference" << endl;
+
+  for( size_t index=0; index < engines.size(); ++index )
+  {
+    print_engine(engines[index], "  DIFFERS");
+    delete engines[index].tracker;
+  }
+
+  print_engine(legacy, "  expected, the original split some shapes");
+
+  return differing_images;
+}
+
+
+/** The whole of a file, empty if it can't be read */
+static string file_contents(const string &file_name)
+{
+  ifstream file(file_name.c_str(), ios::binary);
+  ostringstream contents;
+  contents << file.rdbuf();
+
+  return contents.str();
+}
+
+
+/** Sorts the track points as runbot_tracking does, so the output is the same */
+static bool frame_line_order(const Point2d &p1, const Point2d &p2) { return p1.y < p2.y; }
+
+
+/**
+ * Track the ppm fields in dir with -w one image after another on this thread, as runbot_tracking
+ * does with the display, and write the .mat file it would to out_name. False if the images
+ * couldn't be read.
+ */
+static bool track_serial(const string &dir, const CheckOptions &options, const string &out_name)
+{
+  ImageLoader loader(dir, true);
+
+  int image_count = loader.image_count();
+  if( image_count <= 0 )
+  {
+    cerr << "Error: No images found in " << dir << endl;
+    return false;
+  }
+
+  SpotTracker tracker(options.num_spots, SpotClassifier(options.thresholds));
+
+  MatFileDump outfile(6, out_name, image_count);
+  outfile.addVariable("region_counts", 1);
+  outfile.addVariable("warnings", 1);
+  outfile.addVariable("image_numbers", 1);
+
+  TrackFrame frame;
+  Mat no_display_mask;
+  vector<Point2d> track_points;
+
+  for( int file_num=0; file_num < image_count; ++file_num )
+  {
+    // the windows start again at the start of each of batch mode's chunks
+    if( file_num % batch_chunk == 0 )
+      tracker.set_windowed(true);
+
+    loader.load_frame(file_num, false, frame);
+    int count = tracker.track(file_num, frame, no_display_mask, track_points);
+
+    // back to frame lines, and the leg from the four highest points
+    int field_parity = loader.field_parity(file_num);
+    for( size_t index=0; index < track_points.size(); ++index )
+      track_points[index].y = track_points[index].y*2 + field_parity;
+
+    sort( track_points.begin(), track_points.end(), frame_line_order );
+
+    Point2d leg_centre = (track_points[0] + track_points[1]) * 0.5;
+    double column[6] = { leg_centre.x, leg_centre.y, track_points[2].x, track_points[2].y, track_points[3].x, track_points[3].y };
+
+    outfile.writeColumn(0, column);
+    outfile.writeDouble(1, count);
+    outfile.writeDouble(2, count < (int)track_points.size() ? 1 : 0);
+    outfile.writeDouble(3, file_num);
+  }
+
+  outfile.finaliseAndClose();
+  return true;
+}
+
+
+/**
+ * Track the ppm fields in dir with runbot_tracking in batch mode with -w, on one thread and on
+ * several (twice, the threads take the images in a different order each time). The .mat files
+ * must all be the same as tracking the images one after another (see track_serial). Returns the
+ * number of runs that differ, -1 on failure.
+ */
+static int check_batch_threads(const string &tracker, const string &dir, const CheckOptions &options, const string &scratch)
+{
+  cout << "runbot_tracking -b -w -m, " << dir << endl;
+
+  char *c_str = realpath(tracker.c_str(), NULL);
+  if( c_str == NULL )
+  {
+    cerr << "Error: Couldn't find " << tracker << endl;
+    return -1;
+  }
+
+  string tracker_path = c_str;
+  free(c_str);
+
+  // the output is named after the directory, and written to the working directory
+  string base = dir.substr( dir.rfind('/', dir.length()-2) + 1 );
+  base.erase( base.length()-1 );
+
+  // the serial run, as the display does it
+  string serial_dir = make_scratch_dir(scratch, "runbot_check_out");
+  if( serial_dir.empty() )
+    return -1;
+
+  bool serial_tracked = track_serial(dir, options, serial_dir + base + "_tracking.mat");
+  string serial_output = file_contents(serial_dir + base + "_tracking.mat");
+  remove_scratch_dir(serial_dir);
+
+  if( !serial_tracked || serial_output.empty() )
+    return -1;
+
+  cout << "  " << left << setw(28) << "serial" << serial_output.size() << " bytes" << endl;
+
+  int runs = sizeof(batch_threads) / sizeof(batch_threads[0]);
+  int differing_runs = 0;
+
+  for( int run=0; run < runs; ++run )
+  {
+    string out_dir = make_scratch_dir(scratch, "runbot_check_out");
+    if( out_dir.empty() )
+      return -1;
+
+    // the same spots and colours as the check
+    ostringstream command;
+    command << "cd '" << out_dir << "' && '" << tracker_path << "' -b -w -m -j " << batch_threads[run]
+            << " -n " << options.num_spots << " -k " << options.thresholds.max_green << ',' << options.thresholds.blue_margin
+            << ',' << options.thresholds.green_margin << " '" << dir << "' >/dev/null 2>&1";
+
+    int status = system( command.str().c_str() );
+    string output = file_contents(out_dir + base + "_tracking.mat");
+    remove_scratch_dir(out_dir);
+
+    if( status != 0 || output.empty() )
+    {
+      cerr << "Error: Failed running " << command.str() << endl;
+      return -1;
+    }
+
+    bool differs = output != serial_output;
+    if( differs )
+      ++differing_runs;
+
+    cout << "  " << left << setw(28) << (string("-j ") + to_string(batch_threads[run])) << output.size() << " bytes"
+         << (differs ? ", DIFFERS from serial" : "") << endl;
+  }
+
+  return differing_runs;
+}
+
+
+static void usage(const char *prog)
+{
+  cerr << "Usage: " << prog << " [-f] [-g fields] [-k thresholds] [-L table] [-n regions] [-r seed] [-e tolerance] [-d dir] [-t tracker] [-v]" << endl
+       << "       [input directory or .y4m stream ...]" << endl
+       << "  -d  directory for the synthetic footage's scratch files (default /tmp)" << endl
+       << "  -e  largest difference between the centres counted as the same, in pixels (default " << default_tolerance << ')' << endl
+       << "  -f  the recorded images are full frames, not video fields" << endl
+       << "  -g  fields of synthetic footage to check, 0 for none (default " << default_field_count << ')' << endl
+       << "  -k  spot colour thresholds max_green,blue_margin,green_margin (default "
+       << default_thresholds.max_green << ',' << default_thresholds.blue_margin << ',' << default_thresholds.green_margin << ')' << endl
+       << "  -L  check the table kernels with the colour table from this file, rather than one made from the thresholds" << endl
+       << "  -n  number of spots to track (default " << default_track_regions << ')' << endl
+       << "  -r  random seed for the synthetic footage's clutter and noise" << endl
+       << "  -t  check this runbot_tracking gives the same output in batch mode with -w on one thread and on several" << endl
+       << "      as tracking the images one after another" << endl
+       << "  -v  print every image that differs, not just the first " << max_reported << " of each engine" << endl;
+}
+
+
+int main( int argc, char** argv )
+{
+  CheckOptions options;
+  options.num_spots = default_track_regions;
+  options.thresholds = default_thresholds;
+  options.fields = true;
+  options.tolerance = default_tolerance;
+  options.verbose = false;
+
+  SyntheticFootage::Settings settings = SyntheticFootage::default_settings();
+  int field_count = default_field_count;
+  string scratch = "/tmp";
+  string table_name;
+  string tracker;
+
+  int opt;
+  while( (opt = getopt(argc, argv, "d:e:fg:hk:L:n:r:t:v")) != -1 )
+  {
+    switch(opt)
+    {
+      case 'd': scratch = optarg; break;
+      case 'e': options.tolerance = atof(optarg); break;
+      case 'f': options.fields = false; break;
+      case 'g': field_count = max( atoi(optarg), 0 ); break;
+      case 'L': table_name = optarg; break;
+      case 'n': options.num_spots = max( atoi(optarg), 1 ); break;
+      case 'r': settings.seed = atoi(optarg); break;
+      case 't': tracker = optarg; break;
+      case 'v': options.verbose = true; break;
+
+      case 'k':
+        if( sscanf(optarg, "%d,%d,%d", &options.thresholds.max_green, &options.thresholds.blue_margin, &options.thresholds.green_margin) != 3 )
+        {
+          cerr << "Error: The -k thresholds must be given as max_green,blue_margin,green_margin" << endl;
+          return -1;
+        }
+        break;
+
+      case 'h':
+        usage(argv[0]);
+        return 0;
+
+      default:
+        usage(argv[0]);
+        return -1;
+    }
+  }
+
+  if( table_name.empty() )
+    options.table = SpotColourTable(options.thresholds);
+  else if( !options.table.load(table_name) )
+    return -1;
+
+  int differing_images = 0;
+  int differing_runs = 0;
+
+  if( field_count > 0 )
+  {
+    // the synthetic footage as ppm fields, and as a stream for the chroma planes
+    string dir = make_scratch_dir(scratch, "runbot_check");
+    if( dir.empty() )
+      return -1;
+
+    SyntheticFootage footage(settings);
+    string y4m_name = dir + "synthetic.y4m";
+
+    if( !footage.write_ppm(dir, field_count) || !footage.write_y4m(y4m_name, field_count) )
+    {
+      remove_scratch_dir(dir);
+      return -1;
+    }
+
+    CheckOptions synthetic_options = options;
+    synthetic_options.fields = true;
+
+    int ppm_differing = check_sequence(dir, false, synthetic_options);
+    int y4m_differing = check_sequence(y4m_name, true, synthetic_options);
+    differing_runs = tracker.empty() ? 0 : check_batch_threads(tracker, dir, synthetic_options, scratch);
+
+    remove_scratch_dir(dir);
+
+    if( ppm_differing < 0 || y4m_differing < 0 || differing_runs < 0 )
+      return -1;
+
+    differing_images += ppm_differing + y4m_differing;
+  }
+
+  // recordings
+  for( int arg = optind; arg < argc; ++arg )
+  {
+    string path = argv[arg];
+
+    struct stat path_stat;
+    if( stat(path.c_str(), &path_stat) != 0 )
+    {
+      cerr << "Error: Couldn't find " << path << endl;
+      return -1;
+    }
+
+    if( S_ISDIR(path_stat.st_mode) && *path.rbegin() != '/' )
+      path += '/';
+
+    int differing = check_sequence(path, !S_ISDIR(path_stat.st_mode), options);
+    if( differing < 0 )
+      return -1;
+
+    differing_images += differing;
+  }
+
+  if( differing_images > 0 || differing_runs > 0 )
+  {
+    cout << differing_images << " images differ from the reference (true connected components), " << differing_runs
+         << " batch mode runs differ from tracking the images one after another" << endl;
+    return 1;
+  }
+
+  cout << "All the engines match the reference (true connected components)" << endl;
+  return 0;
+}
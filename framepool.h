@@ -0,0 +1,52 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+/**
+ * A set of image buffers that are handed out again once nothing else refers to them, so loading
+ * image after image reuses the same memory instead of allocating. A buffer is free again when
+ * the pool holds the only reference to it - the reference count is shared, so images may be
+ * released on any thread. This relies on the cv::Mat::refcount of OpenCV 2.x. The pool grows
+ * to the number of buffers in use at once, up to its limit, after that images are allocated as
+ * normal.
+ */
+class FramePool
+{
+  public:
+    FramePool(size_t limit) : limit(limit) {}
+
+    void set_limit(size_t limit) { this->limit = limit; }
+
+    /** Get a free buffer for a size x type image, the contents are left over from its last use */
+    cv::Mat take(cv::Size size, int type)
+    {
+      for( size_t index=0; index<buffers.size(); ++index )
+      {
+        cv::Mat &buffer = buffers[index];
+
+        // other threads drop their references with an atomic decrement (CV_XADD, a full barrier),
+        // the acquire load pairs with it so they have finished with the pixels before they are
+        // overwritten
+        if( __atomic_load_n(buffer.refcount, __ATOMIC_ACQUIRE) == 1 )
+        {
+          buffer.create(size, type);   // only allocates if the size has changed
+          return buffer;
+        }
+      }
+
+      cv::Mat buffer(size, type);
+      if( buffers.size() < limit )
+        buffers.push_back(buffer);
+
+      return buffer;
+    }
+
+  private:
+    std::vector<cv::Mat> buffers;
+    size_t limit;
+};
+
+#endif // FRAMEPOOL_H
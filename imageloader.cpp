@@ -0,0 +1,178 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Graeme Hattan                                   *
+ *   graemeh.dev@googlemail.com                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+
+#include <dirent.h>
+#include <errno.h>
+
+#include "imageloader.h"
+#include "stagestats.h"
+
+using namespace std;
+using namespace cv;
+
+
+ImageLoader::ImageLoader(const string &path, bool fields, bool split_frames) :
+  path(path),
+  pool(4),
+  fields(fields),
+  split_frames(split_frames),
+  split_frame_num(-1)
+{
+  if( *path.rbegin() != '/' && !y4m.open(path) )
+    exit(-1);
+}
+
+
+string ImageLoader::file_num_to_name(int file_num)
+{
+  ostringstream num_convert;
+  num_convert << setw(8) << setfill('0') << file_num << ".ppm";
+  return num_convert.str();
+}
+
+
+int ImageLoader::count_ppm(const char *path)
+{
+  int file_count = 0;
+  DIR *dir;
+  struct dirent *entry;
+
+  if( (dir = opendir(path)) == NULL )
+    return -1;
+
+  errno = 0;
+
+  while( (entry = readdir(dir)) != NULL )
+  {
+    if( entry->d_type == DT_REG                 // regular file
+        && strlen(entry->d_name) == 12          // files are 8 digits plus .ppm extension
+        && strcmp(entry->d_name+8, ".ppm") == 0 )
+    {
+      ++file_count;
+    }
+  }
+
+  // check the end of the directory was actually reached without error
+  if( errno != 0 )
+    file_count = -1;
+
+  closedir(dir);
+
+  return file_count;
+}
+
+
+int ImageLoader::image_count() const
+{
+  if( !y4m.is_open() )
+  {
+    int file_count = count_ppm( path.c_str() );
+    return split_frames && file_count > 0 ? file_count * 2 : file_count;
+  }
+
+  return fields ? y4m.frame_count() * 2 : y4m.frame_count();
+}
+
+
+int ImageLoader::field_parity(int file_num) const
+{
+  if( !fields )
+    return -1;
+
+  // fields from individual files are assumed to be top field first
+  if( !y4m.is_open() )
+    return file_num % 2;
+
+  return (file_num % 2) ^ (y4m.bottom_field_first() ? 1 : 0);
+}
+
+
+void ImageLoader::load_planes(int file_num, Mat &y, Mat &cb, Mat &cr)
+{
+  assert( y4m.is_open() );
+
+  if( fields )
+    y4m.field_planes(file_num/2, field_parity(file_num), y, cb, cr);
+  else
+    y4m.frame_planes(file_num, y, cb, cr);
+}
+
+
+void ImageLoader::load_image(int file_num, Mat &image)
+{
+  StageTimer timer(STAGE_LOAD);
+
+  if( y4m.is_open() )
+  {
+    // views straight into the mapped stream, only the colour conversion writes anything
+    Mat y, cb, cr;
+    load_planes(file_num, y, cb, cr);
+
+    image.release();
+    image = pool.take(y.size(), CV_8UC3);
+    ycbcr_to_bgr(y, cb, cr, image);
+  }
+  else if( split_frames )
+  {
+    // the frame is loaded for the first of its fields, the second is another view of it
+    if( file_num/2 != split_frame_num )
+    {
+      load_file(file_num/2, split_frame);
+      split_frame_num = file_num/2;
+    }
+
+    image = field_lines(split_frame, field_parity(file_num));
+  }
+  else
+    load_file(file_num, image);
+}
+
+
+void ImageLoader::load_file(int file_num, Mat &image)
+{
+  string file_name = path + file_num_to_name(file_num);
+
+  if( ppm.open(file_name) )
+  {
+    image.release();
+    image = pool.take(ppm.size(), CV_8UC3);
+
+    bool read = ppm.read(image);
+    ppm.close();
+
+    if( !read )
+      exit(-1);
+  }
+  else
+  {
+    // anything other than a binary PPM, load the image or exit
+    image = imread( file_name );
+    if( image.data == 0 )
+    {
+      cerr << "Error: Couldn't find " << file_name << endl;
+      exit(-1);
+    }
+  }
+}
+
+
+void ImageLoader::load_frame(int file_num, bool planes, TrackFrame &frame)
+{
+  if( planes )
+    load_planes(file_num, frame.y, frame.cb, frame.cr);
+  else
+    load_image(file_num, frame.bgr);
+}
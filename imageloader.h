@@ -0,0 +1,87 @@
+#ifndef IMAGELOADER_H
+#define IMAGELOADER_H
+
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "framepool.h"
+#include "ppmreader.h"
+#include "spottracker.h"
+#include "y4mreader.h"
+
+/**
+ * Class to load the images. The input is either a directory
+ * of xxxxxxxx.ppm files or a YUV4MPEG2 stream straight from mplayer, which is split into
+ * fields here if the images are to be fields. The ppm files can also be interlaced frames that
+ * are split into fields here. Fields are views of every other line of the frame, which is only
+ * loaded once for both of them.
+ */
+class ImageLoader
+{
+  public:
+    /** path is a directory (with trailing slash) of ppm files, otherwise a y4m file - exits if it can't be opened */
+    ImageLoader(const std::string &path, bool fields, bool split_frames=false);
+
+    static std::string file_num_to_name(int file_num);
+
+    /** Count xxxxxxxx.ppm files in directory */
+    static int count_ppm(const char *path);
+
+    /** Number of images (fields if the images are fields) available, -1 on error */
+    int image_count() const;
+
+    /**
+     * Which lines of the full frame a field comes from, 0 for the even lines and 1 for odd, or
+     * -1 if the images are full frames
+     */
+    int field_parity(int file_num) const;
+
+    /** True if the input is a stream with subsampled chroma planes that can be used directly */
+    bool has_chroma_planes() const { return y4m.is_open() && y4m.chroma_shift() > 0; }
+
+    /**
+     * Get views of the Y, Cb and Cr planes of an image straight from the mapped stream. Only
+     * available for stream input.
+     */
+    void load_planes(int file_num, cv::Mat &y, cv::Mat &cb, cv::Mat &cr);
+
+    /**
+     * Most images loaded at once that are still in use (e.g. kept in a cache), their buffers
+     * are reused rather than allocated for each image
+     */
+    void set_buffer_limit(int count) { pool.set_limit(count); }
+
+    /** Load an image into image, its old buffer is reused if nothing else is using it */
+    void load_image(int file_num, cv::Mat &image);
+
+    /** Load a ppm file (or anything else imread can load) into image, or exit */
+    void load_file(int file_num, cv::Mat &image);
+
+    cv::Mat &load_image(int file_num)
+    {
+      load_image(file_num, image_orig);
+      return image_orig;
+    }
+
+    /** Load an image for tracking - just the planes when tracking on them, otherwise BGR */
+    void load_frame(int file_num, bool planes, TrackFrame &frame);
+
+  private:
+    std::string path;   // directory (with trailing slash) of ppm files, otherwise a y4m file
+
+    Y4mReader y4m;
+    PpmReader ppm;
+
+    // buffers the images are loaded into, reused once the images are finished with
+    FramePool pool;
+
+    bool fields;            // stream frames are split into two images
+    bool split_frames;      // ppm files are frames, each one is two images
+    cv::Mat split_frame;    // the last frame loaded to split
+    int split_frame_num;
+
+    cv::Mat image_orig;
+};
+
+#endif // IMAGELOADER_H
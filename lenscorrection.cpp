@@ -0,0 +1,58 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Graeme Hattan                                   *
+ *   graemeh.dev@googlemail.com                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <iostream>
+
+#include "lenscorrection.h"
+#include "stagestats.h"
+
+using namespace std;
+using namespace cv;
+
+
+bool LensCorrection::open(const string &file_name)
+{
+  FileStorage calib(file_name, FileStorage::READ);
+
+  if( !calib.isOpened() )
+  {
+    cerr << "Error: Failed opening " << file_name << endl;
+    return false;
+  }
+
+  calib["Camera_Matrix"]           >> cam_matrix;
+  calib["Distortion_Coefficients"] >> dist_coeff;
+  calib["image_Width"]             >> size.width;
+  calib["image_Height"]            >> size.height;
+
+  if( cam_matrix.empty() || dist_coeff.empty() || size.width <= 0 || size.height <= 0 )
+  {
+    cerr << "Error: " << file_name << " is missing the camera matrix, distortion coefficients or image size" << endl;
+    return false;
+  }
+
+  new_cam_matrix = getOptimalNewCameraMatrix(cam_matrix, dist_coeff, size, 1, size);
+
+  return true;
+}
+
+
+void LensCorrection::undistort(vector<Point2d> &points) const
+{
+  if( points.empty() )
+    return;
+
+  StageTimer timer(STAGE_UNDISTORT);
+
+  vector<Point2d> undistorted;
+  undistortPoints(points, undistorted, cam_matrix, dist_coeff, Mat(), new_cam_matrix);
+
+  points.swap(undistorted);
+}
@@ -0,0 +1,35 @@
+#ifndef LENSCORRECTION_H
+#define LENSCORRECTION_H
+
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+/**
+ * Corrects the lens distortion of tracked points using a camera calibration (calib.xml, as
+ * written by the OpenCV camera calibration sample). Only the points are undistorted, so the
+ * tracking runs on the raw images and there is no per image remap. The points come out in the
+ * same coordinates a full image undistortion keeping all the source pixels (alpha 1) would give.
+ */
+class LensCorrection
+{
+  public:
+    /** Read the calibration, false (with an error message) on failure */
+    bool open(const std::string &file_name);
+
+    /** Size of the full frames the calibration was made with */
+    const cv::Size &image_size() const { return size; }
+
+    /** Undistort points (in full frame coordinates) in place */
+    void undistort(std::vector<cv::Point2d> &points) const;
+
+  private:
+    cv::Mat cam_matrix;
+    cv::Mat dist_coeff;
+    cv::Mat new_cam_matrix;
+
+    cv::Size size;
+};
+
+#endif // LENSCORRECTION_H
@@ -1,100 +1,159 @@
-#include <QCoreApplication>
-#include <QtDebug>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "matfiledump.h"
 
-#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
 #error MatFileDump class currently only works on little endian machines
 #endif
 
-const char MatFileDump::matFileHeaderDoubleLE2D[] =
-{
-    0x53, 0x74, 0x61, 0x6e, 0x64, 0x61, 0x72, 0x64,
-    0x20, 0x2e, 0x6d, 0x61, 0x74, 0x20, 0x68, 0x65,
-    0x61, 0x64, 0x65, 0x72, 0x20, 0x74, 0x6f, 0x20,
-    0x64, 0x75, 0x6d, 0x70, 0x20, 0x32, 0x44, 0x20,
-    0x61, 0x72, 0x72, 0x61, 0x79, 0x20, 0x6f, 0x66,
-    0x20, 0x4c, 0x45, 0x20, 0x64, 0x6f, 0x75, 0x62,
-    0x6c, 0x65, 0x2e, 0x20, 0x4f, 0x66, 0x66, 0x73,
-    0x65, 0x74, 0x73, 0x3a, 0x20, 0x41, 0x30, 0x2d,
-    0x43, 0x6f, 0x6c, 0x75, 0x6d, 0x6e, 0x73, 0x2c,
-    0x41, 0x34, 0x2d, 0x52, 0x6f, 0x77, 0x73, 0x2c,
-    0x43, 0x34, 0x2d, 0x54, 0x6f, 0x74, 0x61, 0x6c,
-    0x44, 0x61, 0x74, 0x61, 0x42, 0x79, 0x74, 0x65,
-    0x73, 0x20, 0x56, 0x61, 0x6c, 0x75, 0x65, 0x73,
-    0x3a, 0x20, 0x49, 0x6e, 0x74, 0x33, 0x32, 0x2c,
-    0x4c, 0x45, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
-    0x20, 0x20, 0x20, 0x20, 0x00, 0x01, 0x49, 0x4d,
-    0x0e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x06, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00,
-    0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x05, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x01, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00,
-    0x64, 0x61, 0x74, 0x61, 0x5f, 0x61, 0x72, 0x72,
-    0x61, 0x79, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-};
-
-MatFileDump::MatFileDump(quint32 rows, const QString &name) :
-    QFile(name),
-    rows(rows),
-    valuesWritten(0),
-    finalised(false)
-{
-  if( open(QIODevice::WriteOnly | QIODevice::Truncate) == false )
-  {
-    qDebug() << "Failed opening" << name;
-    QCoreApplication::exit(1);
-  }
+using namespace std;
 
-  if( write(matFileHeaderDoubleLE2D, sizeof(matFileHeaderDoubleLE2D)) != sizeof(matFileHeaderDoubleLE2D) )
-    writeFail();
+// descriptive text at the start of the file, padded out to 116 bytes with spaces
+const char MatFileDump::matFileHeader[] = "MATLAB 5.0 MAT-file, 2D arrays of LE double written by MatFileDump";
+
+// data types and the array class used in the file
+enum { miINT8 = 1, miINT32 = 5, miUINT32 = 6, miDOUBLE = 9, miMATRIX = 14 };
+enum { mxDOUBLE_CLASS = 6 };
+
+
+MatFileDump::MatFileDump(uint32_t rows, const string &name, uint32_t capacity) :
+    fd(-1),
+    capacity(0),
+    buffered(0),
+    started(false),
+    finalised(true)
+{
+  newFile(rows, name, capacity);
 }
 
 
-void MatFileDump::newFile(quint32 rows, const QString &name)
+void MatFileDump::newFile(const string &name, uint32_t capacity)
 {
   finaliseAndClose();
 
-  setFileName(name);
+  fileName = name;
 
-  if( open(QIODevice::WriteOnly | QIODevice::Truncate) == false )
+  fd = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if( fd < 0 )
   {
-    qDebug() << "Failed opening" << name;
-    QCoreApplication::exit(1);
+    cerr << "Error: Failed opening " << name << endl;
+    exit(-1);
   }
 
-  if( write(matFileHeaderDoubleLE2D, sizeof(matFileHeaderDoubleLE2D)) != sizeof(matFileHeaderDoubleLE2D) )
-    writeFail();
+  variables.clear();
+  this->capacity = capacity > 0 ? capacity : defaultCapacity;
+  buffered = 0;
 
-  this->rows = rows;
-  valuesWritten = 0;
+  started = false;
   finalised = false;
 }
 
 
+void MatFileDump::newFile(uint32_t rows, const string &name, uint32_t capacity)
+{
+  newFile(name, capacity);
+  addVariable("data_array", rows);
+}
+
+
 MatFileDump::~MatFileDump()
 {
   finaliseAndClose();
 }
 
 
-void MatFileDump::writeDouble(const double &data)
+int MatFileDump::addVariable(const string &varName, uint32_t rows)
 {
-  if(write((const char*)&data, 8) != 8)
-    writeFail();
+  if( started || finalised )
+  {
+    cerr << "Error: Variables must be added to " << fileName << " before writing to it" << endl;
+    exit(-1);
+  }
 
-  ++valuesWritten;
+  Variable variable;
+  variable.name = varName;
+  variable.rows = rows;
+  variable.capacity = 0;
+  variable.valuesWritten = 0;
+  variable.offset = 0;
+
+  variables.push_back(variable);
+
+  return variables.size() - 1;
+}
+
+
+void MatFileDump::writeDouble(const double &data)
+{
+  writeDouble(0, data);
 }
 
 
 void MatFileDump::operator<<(const double &data)
 {
-  if(write((const char*)&data, 8) != 8)
-    writeFail();
+  writeDouble(0, data);
+}
+
+
+void MatFileDump::writeDouble(int variable, const double &data)
+{
+  variables[variable].buffer.push_back(data);
+
+  if( ++buffered >= flushValues )
+    flush();
+}
+
+
+void MatFileDump::writeColumn(int variable, const double *column)
+{
+  vector<double> &buffer = variables[variable].buffer;
+  buffer.insert( buffer.end(), column, column + variables[variable].rows );
 
-  ++valuesWritten;
+  buffered += variables[variable].rows;
+  if( buffered >= flushValues )
+    flush();
+}
+
+
+void MatFileDump::flush()
+{
+  if( finalised )
+    return;
+
+  if( !started )
+    start();
+
+  // one write for each variable's block of values...
+  for( size_t index=0; index < variables.size(); ++index )
+  {
+    Variable &variable = variables[index];
+
+    if( variable.buffer.empty() )
+      continue;
+
+    uint64_t values = variable.valuesWritten + variable.buffer.size();
+    uint32_t columns = (values + variable.rows - 1) / variable.rows;
+
+    if( columns > variable.capacity )
+      grow(index, columns);
+
+    writeAt( dataOffset(variable) + variable.valuesWritten*8, &variable.buffer[0], variable.buffer.size()*8 );
+
+    variable.valuesWritten = values;
+    variable.buffer.clear();
+  }
+
+  buffered = 0;
+
+  // ...then the sizes, so the file only ever claims values which are there
+  for( size_t index=0; index < variables.size(); ++index )
+    writeSizes(variables[index]);
 }
 
 
@@ -103,71 +162,239 @@ void MatFileDump::finaliseAndClose()
   if(finalised)
     return;
 
-  quint32 columns = valuesWritten / rows;
-  quint32 remainder = valuesWritten % rows;
+  flush();
 
-  // add zeros to end of file if the last column hasn't been filled
-  if(remainder > 0)
+  for( size_t index=0; index < variables.size(); ++index )
   {
-    qDebug() << "Last column of" << rows << "row matrix in" << fileName() << "not filled, adding zeros";
-    quint32 zeros = rows - remainder;
-    double zero = 0;
-
-    valuesWritten += zeros;
-    ++columns;
+    Variable &variable = variables[index];
+    uint32_t remainder = variable.valuesWritten % variable.rows;
 
-    while(zeros--)
+    // add zeros to the end of the matrix if the last column hasn't been filled
+    if(remainder > 0)
     {
-      if( write((char*)&zero, 8) != 8 )
-        writeFail();
+      cerr << "Last column of " << variable.rows << " row matrix " << variable.name << " in " << fileName << " not filled, adding zeros" << endl;
+      variable.buffer.assign(variable.rows - remainder, 0.0);
+      buffered += variable.buffer.size();
     }
   }
 
-  quint32 totalDataBytes = valuesWritten * 8;
-  quint32 elementSize    = elementHeaderSize + totalDataBytes;
+  flush();
+  pack();
 
+  close(fd);
+  fd = -1;
 
-  // write total element size
-  if( seek(elementSizeOffset) == false )
-    seekFail(elementSizeOffset);
+  finalised = true;
+}
 
-  if( write((char*)&elementSize, 4) != 4 )
-    writeFail();
 
+/** Write the file header and lay the variables out, each with space for capacity columns */
+void MatFileDump::start()
+{
+  if( variables.empty() )
+  {
+    cerr << "Error: No variables to write in " << fileName << endl;
+    exit(-1);
+  }
+
+  char header[128];
+  memset(header, ' ', 116);
+  memcpy(header, matFileHeader, strlen(matFileHeader));
+
+  memset(header + 116, 0, 8);   // no subsystem data
+  header[124] = 0x00;           // version 0x0100
+  header[125] = 0x01;
+  header[126] = 'I';            // endian indicator, reads 'IM' on a little endian machine
+  header[127] = 'M';
 
-  // write numbers of columns and rows in matrix
-  if( seek(columnsRowsOffset) == false )
-    seekFail(columnsRowsOffset);
+  writeAt(0, header, sizeof(header));
 
-  if( write((char*)&rows, 4) != 4 )
+  off_t offset = sizeof(header);
+
+  for( size_t index=0; index < variables.size(); ++index )
+  {
+    Variable &variable = variables[index];
+
+    variable.offset = offset;
+    variable.capacity = capacity;
+    writeHeader(variable, variable.capacity);
+
+    offset = dataOffset(variable) + (off_t)variable.capacity * variable.rows * 8;
+  }
+
+  if( ftruncate(fd, offset) != 0 )
     writeFail();
 
-  if( write((char*)&columns, 4) != 4 )
+  started = true;
+}
+
+
+/** Make space for more columns in a variable - the variables after it are moved up */
+void MatFileDump::grow(size_t grow_index, uint32_t columns)
+{
+  Variable &growing = variables[grow_index];
+  growing.capacity = max(columns, growing.capacity*2);
+  writeHeader(growing, growing.capacity);
+
+  // the new positions, working back from the end so nothing is overwritten before it is moved
+  vector<off_t> offsets(variables.size());
+
+  off_t offset = dataOffset(growing) + (off_t)growing.capacity * growing.rows * 8;
+  for( size_t index = grow_index+1; index < variables.size(); ++index )
+  {
+    offsets[index] = offset;
+    offset += headerSize(variables[index]) + (off_t)variables[index].capacity * variables[index].rows * 8;
+  }
+
+  if( ftruncate(fd, offset) != 0 )
     writeFail();
 
+  for( size_t index = variables.size()-1; index > grow_index; --index )
+  {
+    Variable &variable = variables[index];
+
+    off_t from = dataOffset(variable);
+    variable.offset = offsets[index];
+
+    moveData(variable, from);
+    writeHeader(variable, variable.capacity);
+  }
+}
+
+
+/** Move the variables down to leave no unused space between them and cut the file to size */
+void MatFileDump::pack()
+{
+  off_t offset = variables[0].offset;
+
+  for( size_t index=0; index < variables.size(); ++index )
+  {
+    Variable &variable = variables[index];
 
-  // write the number of bytes of actual data
-  if( seek(totalDataBytesOffset) == false )
-    seekFail(totalDataBytesOffset);
+    off_t from = dataOffset(variable);
+    variable.offset = offset;
+    variable.capacity = variable.valuesWritten / variable.rows;
 
-  if( write((char*)&totalDataBytes, 4) != 4 )
+    moveData(variable, from);
+    writeHeader(variable, variable.capacity);
+
+    offset = dataOffset(variable) + (off_t)variable.capacity * variable.rows * 8;
+  }
+
+  if( ftruncate(fd, offset) != 0 )
     writeFail();
+}
 
 
-  close();
-  finalised = true;
+/** Write the matrix element header of a variable with space for reservedColumns */
+void MatFileDump::writeHeader(const Variable &variable, uint32_t reservedColumns)
+{
+  uint32_t nameLength = variable.name.size();
+  uint32_t size = headerSize(variable);
+
+  vector<char> header(size, 0);
+  uint32_t *words = (uint32_t *)&header[0];
+
+  // matrix element, the size of everything after the tag including the unused space
+  words[0] = miMATRIX;
+  words[1] = size - 8 + reservedColumns * variable.rows * 8;
+
+  // array flags
+  words[2] = miUINT32;
+  words[3] = 8;
+  words[4] = mxDOUBLE_CLASS;
+
+  // dimensions, the number of columns is filled in by writeSizes()
+  words[6] = miINT32;
+  words[7] = 8;
+  words[8] = variable.rows;
+
+  // name
+  words[10] = miINT8;
+  words[11] = nameLength;
+  memcpy(&header[48], variable.name.data(), nameLength);
+
+  // real part, its size is filled in by writeSizes()
+  words[ (size-8)/4 ] = miDOUBLE;
+
+  writeAt(variable.offset, &header[0], size);
+  writeSizes(variable);
 }
 
 
-void MatFileDump::writeFail()
+/** Update the number of columns of a variable in the file to the whole columns written */
+void MatFileDump::writeSizes(const Variable &variable)
+{
+  uint32_t columns = variable.valuesWritten / variable.rows;
+  uint32_t dataBytes = columns * variable.rows * 8;
+
+  writeAt(variable.offset + 36, &columns, 4);
+  writeAt(dataOffset(variable) - 4, &dataBytes, 4);
+}
+
+
+/** Copy the values written for a variable from their old position to where it is now */
+void MatFileDump::moveData(const Variable &variable, off_t from)
 {
-  qDebug() << "Failed writing to" << fileName();
-  QCoreApplication::exit(1);
+  off_t to = dataOffset(variable);
+
+  if( from == to || variable.valuesWritten == 0 )
+    return;
+
+  vector<double> values(variable.valuesWritten);
+  readAt(from, &values[0], values.size()*8);
+  writeAt(to, &values[0], values.size()*8);
 }
 
 
-void MatFileDump::seekFail(qint64 pos)
+uint32_t MatFileDump::nameBytes(const string &varName)
+{
+  return (varName.size() + 7) & ~7;   // padded to 8 bytes
+}
+
+
+uint32_t MatFileDump::headerSize(const Variable &variable)
+{
+  // tag, array flags, dimensions, name and the real part's tag
+  return 8 + 16 + 16 + 8 + nameBytes(variable.name) + 8;
+}
+
+
+off_t MatFileDump::dataOffset(const Variable &variable)
+{
+  return variable.offset + headerSize(variable);
+}
+
+
+void MatFileDump::writeAt(off_t pos, const void *data, size_t bytes)
+{
+  const char *ptr = (const char *)data;
+
+  while( bytes > 0 )
+  {
+    ssize_t written = pwrite(fd, ptr, bytes, pos);
+    if( written <= 0 )
+      writeFail();
+
+    ptr += written;
+    pos += written;
+    bytes -= written;
+  }
+}
+
+
+void MatFileDump::readAt(off_t pos, void *data, size_t bytes)
+{
+  if( pread(fd, data, bytes, pos) != (ssize_t)bytes )
+  {
+    cerr << "Error: Failed reading back " << fileName << endl;
+    exit(-1);
+  }
+}
+
+
+void MatFileDump::writeFail()
 {
-  qDebug() << "Failed seeking to" << pos << "in" << fileName();
-  QCoreApplication::exit(1);
+  cerr << "Error: Failed writing to " << fileName << endl;
+  exit(-1);
 }
@@ -1,38 +1,95 @@
 #ifndef MATFILEDUMP_H
 #define MATFILEDUMP_H
 
-#include <QFile>
+#include <stdint.h>
+#include <sys/types.h>
 
-class MatFileDump : private QFile
+#include <string>
+#include <vector>
+
+/**
+ * Writes 2D double matrices to a Matlab v5 .mat file a column at a time. Several variables can
+ * be written to one file, each is given space for a number of columns up front (grown as
+ * needed) so they can all be written at once. Values are buffered and written out in blocks,
+ * the matrix sizes are updated in the file after each block so the file is always loadable -
+ * a run that is killed loses at most the values still buffered. The file is packed down to
+ * just the values written when it is finalised.
+ */
+class MatFileDump
 {
 public:
-  MatFileDump() : QFile(), finalised(true) {}
-  MatFileDump(quint32 rows, const QString &name="variable_dump.mat");
+  MatFileDump() : fd(-1), capacity(0), buffered(0), started(false), finalised(true) {}
+  MatFileDump(uint32_t rows, const std::string &name="variable_dump.mat", uint32_t capacity=0);
   ~MatFileDump();
 
-  void newFile(quint32 rows, const QString &name="variable_dump.mat");
+  /** Start a new file, variables have to be added before anything is written */
+  void newFile(const std::string &name="variable_dump.mat", uint32_t capacity=0);
+
+  /** Start a new file with a single rows x n variable called data_array */
+  void newFile(uint32_t rows, const std::string &name, uint32_t capacity=0);
 
+  /** Add a rows x n variable, returns its index for writing to */
+  int addVariable(const std::string &varName, uint32_t rows);
+
+  // write to the first variable, one value at a time down the columns
   void writeDouble(const double &data);
   void operator<<(const double &data);
 
+  void writeDouble(int variable, const double &data);
+  void writeColumn(int variable, const double *column);
+
+  /** Write out everything buffered and update the matrix sizes in the file */
+  void flush();
+
   void finaliseAndClose();
 
+  /** True from newFile() until the file is finalised */
+  bool isOpen() const { return !finalised; }
+
 private:
+  struct Variable
+  {
+    std::string name;
+    uint32_t rows;
+
+    uint32_t capacity;        // columns of space in the file
+    uint64_t valuesWritten;   // values in the file, not counting those buffered
+    off_t offset;             // of the matrix element
+
+    std::vector<double> buffer;
+  };
+
+  void start();
+  void grow(size_t grow_index, uint32_t columns);
+  void pack();
+
+  void writeHeader(const Variable &variable, uint32_t reservedColumns);
+  void writeSizes(const Variable &variable);
+  void moveData(const Variable &variable, off_t from);
+
+  static uint32_t nameBytes(const std::string &varName);
+  static uint32_t headerSize(const Variable &variable);
+  static off_t dataOffset(const Variable &variable);
+
+  void writeAt(off_t pos, const void *data, size_t bytes);
+  void readAt(off_t pos, void *data, size_t bytes);
   void writeFail();
-  void seekFail(qint64 pos);
 
-  quint32 rows;
-  quint32 valuesWritten;
+  std::string fileName;
+  int fd;
 
-  bool finalised;
+  std::vector<Variable> variables;
+  uint32_t capacity;   // columns of space to start each variable with
+
+  size_t buffered;     // values buffered over all the variables
 
-  static const qint64 elementSizeOffset = 0x84;
-  static const qint64 columnsRowsOffset = 0xA0;
-  static const qint64 totalDataBytesOffset = 0xC4;
+  bool started;
+  bool finalised;
 
-  static const quint32 elementHeaderSize = 64;
+  static const size_t flushValues = 4096;   // buffered values that trigger a write
+  static const uint32_t defaultCapacity = 1024;
 
-  static const char matFileHeaderDoubleLE2D[];
+  static const char matFileHeader[];
 };
 
 #endif // MATFILEDUMP_H
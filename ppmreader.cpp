@@ -0,0 +1,151 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Graeme Hattan                                   *
+ *   graemeh.dev@googlemail.com                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <iostream>
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ppmreader.h"
+
+using namespace std;
+using namespace cv;
+
+
+PpmReader::PpmReader() :
+  fd(-1),
+  width(0),
+  height(0)
+{
+}
+
+
+PpmReader::~PpmReader()
+{
+  close();
+}
+
+
+bool PpmReader::open(const string &file_name)
+{
+  close();
+
+  this->file_name = file_name;
+
+  fd = ::open(file_name.c_str(), O_RDONLY);
+  if( fd < 0 )
+    return false;
+
+  char data[max_header];
+  ssize_t length = pread(fd, data, max_header, 0);
+  if( length <= 0 )
+  {
+    close();
+    return false;
+  }
+
+  // the same header as the last image, nothing to check
+  if( !header.empty() && (size_t)length >= header.size() && memcmp(data, header.data(), header.size()) == 0 )
+    return true;
+
+  if( !parse_header(data, length) )
+  {
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+
+void PpmReader::close()
+{
+  if( fd >= 0 )
+    ::close(fd);
+
+  fd = -1;
+}
+
+
+bool PpmReader::read(Mat &bgr)
+{
+  assert( fd >= 0 && bgr.isContinuous() && bgr.type() == CV_8UC3 && bgr.size() == size() );
+
+  size_t bytes = (size_t)width * height * 3;
+  unsigned char *pixels = bgr.data;
+
+  for( size_t done = 0; done < bytes; )
+  {
+    ssize_t length = pread(fd, pixels + done, bytes - done, header.size() + done);
+    if( length <= 0 )
+    {
+      cerr << "Error: " << file_name << " is shorter than its header says" << endl;
+      return false;
+    }
+
+    done += length;
+  }
+
+  // the pixels are stored RGB
+  for( unsigned char *end = pixels + bytes; pixels < end; pixels += 3 )
+    swap(pixels[0], pixels[2]);
+
+  return true;
+}
+
+
+/** Parse "P6 <width> <height> <maxval>" with any comments, the header ends at a single whitespace */
+bool PpmReader::parse_header(const char *data, size_t length)
+{
+  if( length < 2 || data[0] != 'P' || data[1] != '6' )
+    return false;
+
+  size_t pos = 2;
+  int values[3];
+
+  for( int index=0; index<3; ++index )
+  {
+    // whitespace and comments before each value
+    while( pos < length && (isspace(data[pos]) || data[pos] == '#') )
+    {
+      if( data[pos] == '#' )
+        while( pos < length && data[pos] != '\n' )
+          ++pos;
+      else
+        ++pos;
+    }
+
+    if( pos >= length || !isdigit(data[pos]) )
+      return false;
+
+    values[index] = 0;
+    while( pos < length && isdigit(data[pos]) && values[index] < 65536 )
+      values[index] = values[index]*10 + (data[pos++] - '0');
+  }
+
+  // one whitespace character, then the pixels
+  if( pos >= length || !isspace(data[pos]) )
+    return false;
+
+  ++pos;
+
+  if( values[0] <= 0 || values[1] <= 0 || values[2] != 255 )
+    return false;
+
+  width = values[0];
+  height = values[1];
+  header.assign(data, pos);
+
+  return true;
+}
@@ -0,0 +1,42 @@
+#ifndef PPMREADER_H
+#define PPMREADER_H
+
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+/**
+ * Reads 8 bit binary (P6) PPM images, as written for each field by pamsplit, straight into a
+ * BGR image with one read and no allocation. Every image of a recording has the same header,
+ * so the first one is parsed and after that each header only has to match it byte for byte.
+ */
+class PpmReader
+{
+  public:
+    PpmReader();
+    ~PpmReader();
+
+    /** Open an image and check its header, false if it isn't an 8 bit P6 PPM (or can't be read) */
+    bool open(const std::string &file_name);
+    void close();
+
+    cv::Size size() const { return cv::Size(width, height); }
+
+    /** Read the open image into bgr, which must be a continuous 8 bit 3 channel image of size() */
+    bool read(cv::Mat &bgr);
+
+  private:
+    bool parse_header(const char *data, size_t length);
+
+    std::string file_name;
+    int fd;
+
+    int width;
+    int height;
+
+    std::string header;   // header of the last image parsed, the pixels start straight after it
+
+    static const size_t max_header = 256;
+};
+
+#endif // PPMREADER_H
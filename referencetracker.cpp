@@ -0,0 +1,265 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Graeme Hattan                                   *
+ *   graemeh.dev@googlemail.com                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "referencetracker.h"
+
+using namespace std;
+using namespace cv;
+
+
+ReferenceTracker::ReferenceTracker(int num_spots, const SpotClassifier &classifier) :
+  num_spots(num_spots),
+  classifier(classifier)
+{
+}
+
+
+int ReferenceTracker::track(const Mat &image, vector<Point2d> &track_points)
+{
+  region_mask.create(image.size(), CV_32SC1);
+  regions.clear();
+  equivalence.clear();
+
+  // loop through the image and do an adaption of 4 connected component labeling -
+  // http://en.wikipedia.org/wiki/Connected-component_labeling
+  for( int row=0; row < image.rows; ++row )
+  {
+    // create row pointers into image and mask
+    const uchar *image_ptr = image.ptr(row);
+    int *region_mask_ptr = region_mask.ptr<int>(row);
+
+    // loop columns
+    for( int col=0; col < image.cols; ++col )
+    {
+      if( classifier.is_spot(image_ptr) ) // assumes BGR
+      {
+        // pixel deemed to be part of a tracking spot
+
+        // above and left regions - -1 if we are at the edge of the image
+        int region_above = (row==0) ? -1 : region_mask_ptr[ -(int)region_mask.step1() ];
+        int region_left  = (col==0) ? -1 : region_mask_ptr[-1];
+
+        if( region_above >= 0 || region_left >= 0 )
+        {
+          // pixel is connected to a previously found region
+          int min_connected = (region_above < 0) ? region_left : (region_left < 0) ? region_above : min(region_above, region_left);
+          int max_connected = max(region_above, region_left);
+
+          *region_mask_ptr = min_connected;
+          regions[min_connected].add_point(col, row);
+
+          // if pixel is connected to another region, join them - each region points to a lower
+          // equivalent, so join the lowest of each chain
+          if( max_connected != min_connected )
+          {
+            int low = min_connected;
+            while( equivalence[low] != low )
+              low = equivalence[low];
+
+            int high = max_connected;
+            while( equivalence[high] != high )
+              high = equivalence[high];
+
+            if( high < low )
+              swap(high, low);
+
+            equivalence[high] = low;
+          }
+        }
+        else
+        {
+          // pixel not connected to a previously found region - add a new one
+          *region_mask_ptr = regions.size();
+          equivalence.push_back( regions.size() );
+          regions.push_back( Region(col, row) );
+        }
+      }
+      else
+      {
+        // pixel not deemed to be part of a tracking spot
+        *region_mask_ptr = -1;
+      }
+
+      // advance row pointers to the next column
+      image_ptr += 3;
+      ++region_mask_ptr;
+    }
+  }
+
+  // (re)initialise the large region pointers
+  Region empty_region;
+  vector<const Region *> large_regions(num_spots, &empty_region);
+
+  int distinct_region_count = 0;
+
+  // Loop backward over the regions and add each region with an equivalent region (always lower)
+  // to the equivalent region. Once equivalent regions have been accounted for, we keep pointers
+  // to the largest distinct regions (which should be the ones we are looking for).
+  for( int index = (int)regions.size() - 1; index >= 0; --index )
+  {
+    Region &region = regions[index];
+
+    if( equivalence[index] != index )
+    {
+      // total equivalent regions
+      regions[ equivalence[index] ] += region;
+    }
+    else
+    {
+      ++distinct_region_count;
+
+      // keep pointers to the largest regions - do a simple sorting adaption
+      if( region.count() > large_regions[0]->count() )
+      {
+        int place=1;
+        for( ; place < num_spots; ++place )
+        {
+          if( region.count() > large_regions[place]->count() )
+            large_regions[place-1] = large_regions[place];
+          else
+            break;
+        }
+
+        large_regions[place-1] = &region;
+      }
+    }
+  }
+
+  // find the centres of the large regions - these are the track points
+  track_points.resize(num_spots);
+  for( int index=0; index<num_spots; ++index )
+    track_points[index] = large_regions[index]->centre();
+
+  return distinct_region_count;
+}
+
+
+LegacyTracker::LegacyTracker(int num_spots, const SpotClassifier &classifier) :
+  num_spots(num_spots),
+  classifier(classifier),
+  regions(65535)
+{
+}
+
+
+int LegacyTracker::track(const Mat &image, vector<Point2d> &track_points)
+{
+  region_mask.create(image.size(), CV_16UC1);
+
+  int region_count = 0;
+
+  // loop through the image and do an adaption of 4 connected component labeling -
+  // http://en.wikipedia.org/wiki/Connected-component_labeling
+  for( int row=0; row < image.rows; ++row )
+  {
+    // create row pointers into image and mask
+    const uchar *image_ptr = image.ptr(row);
+
+    ushort *region_mask_ptr = region_mask.ptr<ushort>(row);
+
+    // loop columns
+    for( int col=0; col < image.cols; ++col )
+    {
+      if( classifier.is_spot(image_ptr) ) // assumes BGR
+      {
+        // pixel deemed to be part of a tracking spot
+
+        // above and left regions - use 65535 if we are at the edge of the image
+        ushort region_above = (row==0) ? (65535) : (region_mask_ptr[ -(int)region_mask.step1() ]);
+        ushort region_left  = (col==0) ? (65535) : (region_mask_ptr[-1]);
+
+        ushort min_connected = min( region_above, region_left );
+
+        if( min_connected < 65535 )
+        {
+          // pixel is connected to a previously found region
+
+          *region_mask_ptr = min_connected;
+
+          regions[min_connected].add_point(col, row);
+
+          ushort max_connected = max( region_above, region_left );
+
+          // if pixel is connected to another region, set its equivalence to the one with the lower index
+          if( max_connected < 65535 && max_connected != min_connected )
+            regions[max_connected].set_equivalence(min_connected);
+        }
+        else
+        {
+          // pixel not connected to a previously found region - add a new one to the array
+
+          if( region_count >= 65535 )
+            return -1;   // the original exits with "Exceeded maximum regions"
+
+          regions[region_count] = Region(col, row);
+          *region_mask_ptr = region_count++;
+        }
+      }
+      else
+      {
+        // pixel not deemed to be part of a tracking spot
+
+        *region_mask_ptr = 65535;
+      }
+
+      // advance row pointers to the next column
+      image_ptr += 3;
+
+      ++region_mask_ptr;
+    }
+  }
+
+  // (re)initialise the large region pointers
+  Region empty_region(0);
+  vector<Region *> large_regions(num_spots, &empty_region);
+
+  int distinct_region_count = 0;
+
+  // Loop backward over the array of regions and add the necessary internal values of each
+  // region with an equivalent region (always lower) to the equivalent region. Once equivalent
+  // regions have been accounted for, we keep pointers to the largest distinct regions (which
+  // should be the ones we are looking for).
+  while( region_count-- )
+  {
+    Region &region = regions[region_count];
+
+    if( region.equivalence() < 65535 )
+    {
+      // total equivalent regions
+      regions[region.equivalence()] += region;
+    }
+    else
+    {
+      ++distinct_region_count;
+
+      // keep pointers to the largest regions - do a simple sorting adaption
+      if( region.count() > large_regions[0]->count() )
+      {
+        int index=1;
+        for( ; index<num_spots; ++index )
+        {
+          if( region.count() > large_regions[index]->count() )
+            large_regions[index-1] = large_regions[index];
+          else
+            break;
+        }
+
+        large_regions[index-1] = &region;
+      }
+    }
+  }
+
+  // find the centres of the large regions - these are the track points
+  track_points.resize(num_spots);
+  for( int index=0; index<num_spots; ++index )
+    track_points[index] = large_regions[index]->centre();
+
+  return distinct_region_count;
+}
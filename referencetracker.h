@@ -0,0 +1,105 @@
+#ifndef REFERENCETRACKER_H
+#define REFERENCETRACKER_H
+
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "regionlabeler.h"
+#include "spotclassifier.h"
+
+/**
+ * The reference the optimised tracking is checked against (see runbot_check) - true 4 connected
+ * components. It is the original tracker's loop - every pixel of the whole image is tested on
+ * its own and labelled into a region mask, and the largest regions are picked as each distinct
+ * region is totalled up - with the equivalences corrected: the original only kept the lowest
+ * region each region was joined to, splitting shapes joined more than once, where here every
+ * join is kept. Nothing is skipped, decimated, windowed or split, so it is slow but simple
+ * enough to trust - don't optimise it. See LegacyTracker for the original as it was.
+ */
+class ReferenceTracker
+{
+  public:
+    ReferenceTracker(int num_spots, const SpotClassifier &classifier);
+
+    /**
+     * Track a BGR image, as SpotTracker::track does - the centres of the largest num_spots
+     * regions are put into track_points, largest last, with NaN for any not found. Returns
+     * the number of distinct regions found.
+     */
+    int track(const cv::Mat &image, std::vector<cv::Point2d> &track_points);
+
+  private:
+    int num_spots;
+    SpotClassifier classifier;
+
+    cv::Mat region_mask;              // region of each pixel, -1 for none
+    std::vector<Region> regions;      // every region found, including the joined ones
+    std::vector<int> equivalence;     // lower region each region is joined to, itself if none
+};
+
+
+/**
+ * The original tracker's labeling exactly as it was (less the mask display), to show where the
+ * tracking has changed from what it used to output. Regions joined to more than one lower
+ * region are left split, and a 16 bit region mask limits the regions to 65535.
+ */
+class LegacyTracker
+{
+  public:
+    LegacyTracker(int num_spots, const SpotClassifier &classifier);
+
+    /**
+     * Track a BGR image, as ReferenceTracker::track does. Returns the number of distinct regions
+     * found, or -1 if there were too many regions (where the original gave up).
+     */
+    int track(const cv::Mat &image, std::vector<cv::Point2d> &track_points);
+
+  private:
+    /** Class to keep track of the regions found when doing connected component labelling **/
+    class Region
+    {
+      public:
+        Region() {}                     // stops initialisation of the full array of regions
+        Region(int dud) : count_(0) {}  // for empty region
+
+        Region(int x, int y) : count_(1), x_total(x), y_total(y), lowest_equivalence(65535) {}
+
+        // keep a total of all the x and y values of pixels in a region - the centre is the average of these points
+        void add_point( int x, int y ) { ++count_; x_total += x; y_total += y; }
+
+        // only need to keep track of the lowest equivalent for a region
+        void set_equivalence( int region ) { if( region < lowest_equivalence ) lowest_equivalence = region; }
+
+        // some 'getters'
+        const int &equivalence() const { return lowest_equivalence; }
+        const int &count() const { return count_; }
+
+        // the centre is the average of the x and y values of all the pixels in the region
+        cv::Point2d centre() const { return cv::Point2d( (double)x_total/count_, (double)y_total/count_ ); }
+
+        // operator overload for combining regions
+        Region& operator+=(Region& other)
+        {
+          count_ += other.count_;
+          x_total += other.x_total;
+          y_total += other.y_total;
+          return *this;
+        }
+
+      private:
+        int count_;
+        int x_total;
+        int y_total;
+
+        int lowest_equivalence;
+    };
+
+    int num_spots;
+    SpotClassifier classifier;
+
+    cv::Mat region_mask;            // mask to keep track of connected component regions
+    std::vector<Region> regions;    // array for all regions found
+};
+
+#endif // REFERENCETRACKER_H
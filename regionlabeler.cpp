@@ -0,0 +1,226 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Graeme Hattan                                   *
+ *   graemeh.dev@googlemail.com                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "regionlabeler.h"
+
+using namespace std;
+
+typedef SpotClassifier::MaskWord MaskWord;
+
+
+void RunLabeler::reset()
+{
+  runs.clear();
+  parent.clear();
+  run_regions.clear();
+
+  prev_row_begin = 0;
+  row_begin = 0;
+  last_row = -2;
+}
+
+
+void RunLabeler::add_run(int row, int start, int end)
+{
+  Run run = { row, start, end };
+  runs.push_back(run);
+
+  parent.push_back( parent.size() );   // each run starts out as its own region
+
+  run_regions.push_back( Region() );
+  run_regions.back().add_run(row, start, end);
+}
+
+
+int RunLabeler::add_row(int row, const MaskWord *mask, int cols)
+{
+  // the runs of the last row added are only connected to this one if it is directly above
+  prev_row_begin = (row == last_row+1) ? row_begin : (int)runs.size();
+  row_begin = runs.size();
+  last_row = row;
+
+  // find the runs of set bits, a run can carry on over the end of a word
+  bool in_run = false;
+  int run_start = 0;
+
+  for( int word=0, words=SpotClassifier::mask_words(cols); word < words; ++word )
+  {
+    MaskWord bits = mask[word];
+    int base = word * 64;
+
+    // the usual case - a whole word of background, or the middle of a long run
+    if( bits == (in_run ? ~(MaskWord)0 : 0) )
+      continue;
+
+    for( int pos=0; pos < 64; )
+    {
+      // look for the next set bit to start a run, or the next clear bit to end one
+      MaskWord rest = (in_run ? ~bits : bits) >> pos;
+
+      if( rest == 0 )
+        break;
+
+      pos += __builtin_ctzll(rest);
+
+      if( in_run )
+        add_run(row, run_start, base + pos);
+      else
+        run_start = base + pos;
+
+      in_run = !in_run;
+    }
+  }
+
+  if( in_run )
+    add_run(row, run_start, cols);
+
+  join_rows(prev_row_begin, row_begin, row_begin, runs.size());
+
+  return row_begin;
+}
+
+
+/** Join the runs of a row to the overlapping runs of the row above */
+void RunLabeler::join_rows(int above, int above_end, int index, int index_end)
+{
+  // both lists of runs are in column order
+  while( above < above_end && index < index_end )
+  {
+    if( runs[above].start < runs[index].end && runs[index].start < runs[above].end )
+      join(above, index);
+
+    // move on whichever run finishes first, it can't overlap anything else
+    if( runs[above].end <= runs[index].end )
+      ++above;
+    else
+      ++index;
+  }
+}
+
+
+void RunLabeler::append(const RunLabeler &below)
+{
+  int offset = runs.size();
+
+  runs.insert( runs.end(), below.runs.begin(), below.runs.end() );
+  run_regions.insert( run_regions.end(), below.run_regions.begin(), below.run_regions.end() );
+
+  for( size_t index=0; index < below.parent.size(); ++index )
+    parent.push_back( below.parent[index] + offset );
+
+  // the first row of the runs added is only connected to the last row here if it is directly below
+  int seam_end = offset;
+  while( seam_end < (int)runs.size() && runs[seam_end].row == last_row+1 )
+    ++seam_end;
+
+  join_rows(row_begin, offset, offset, seam_end);
+
+  // carry on from the end of the rows added
+  if( below.last_row != -2 )
+  {
+    prev_row_begin = below.prev_row_begin + offset;
+    row_begin = below.row_begin + offset;
+    last_row = below.last_row;
+  }
+}
+
+
+int RunLabeler::find_root(int index)
+{
+  int root = index;
+  while( parent[root] != root )
+    root = parent[root];
+
+  // path compression - point everything on the way straight at the root
+  while( parent[index] != root )
+  {
+    int next = parent[index];
+    parent[index] = root;
+    index = next;
+  }
+
+  return root;
+}
+
+
+void RunLabeler::join(int a, int b)
+{
+  a = find_root(a);
+  b = find_root(b);
+
+  // the root is always the lowest run, i.e. the first one in raster order
+  if( a < b )
+    parent[b] = a;
+  else if( b < a )
+    parent[a] = b;
+}
+
+
+void RunLabeler::resolve(vector<Region> &regions)
+{
+  size_t first_region = regions.size();
+
+  root_region.assign(runs.size(), -1);
+
+  // a run's root is never after it, so regions are created in the order of their first run
+  for( int index=0; index < (int)runs.size(); ++index )
+  {
+    int root = find_root(index);
+
+    if( root_region[root] < 0 )
+    {
+      root_region[root] = regions.size();
+      regions.push_back( Region() );
+    }
+
+    regions[ root_region[root] ] += run_regions[index];
+  }
+
+  // drop regions with no pixels
+  size_t kept = first_region;
+  for( size_t index = first_region; index < regions.size(); ++index )
+  {
+    if( regions[index].count() > 0 )
+      regions[kept++] = regions[index];
+  }
+
+  regions.resize(kept);
+}
+
+
+
+void largest_regions(const vector<Region> &regions, vector<const Region *> &largest, const Region *empty)
+{
+  int count = largest.size();
+
+  // (re)initialise the large region pointers
+  for( int index=0; index<count; ++index )
+    largest[index] = empty;
+
+  // loop backward over the regions - do a simple sorting adaption
+  for( int region_index = (int)regions.size()-1; region_index >= 0; --region_index )
+  {
+    const Region &region = regions[region_index];
+
+    if( region.count() > largest[0]->count() )
+    {
+      int index=1;
+      for( ; index<count; ++index )
+      {
+        if( region.count() > largest[index]->count() )
+          largest[index-1] = largest[index];
+        else
+          break;
+      }
+
+      largest[index-1] = &region;
+    }
+  }
+}
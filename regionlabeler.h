@@ -0,0 +1,165 @@
+#ifndef REGIONLABELER_H
+#define REGIONLABELER_H
+
+#include <vector>
+#include <algorithm>
+#include <climits>
+
+#include <opencv2/opencv.hpp>
+
+#include "spotclassifier.h"
+
+
+/** Class to keep track of the regions found when doing connected component labelling **/
+class Region
+{
+  public:
+    // also used for the empty region
+    Region() : count_(0), x_total(0), y_total(0), min_x(INT_MAX), min_y(INT_MAX), max_x(INT_MIN), max_y(INT_MIN) {}
+
+    Region(int x, int y) : count_(1), x_total(x), y_total(y), min_x(x), min_y(y), max_x(x), max_y(y) {}
+
+    // keep a total of all the x and y values of pixels in a region - the centre is the average of these points
+    void add_point( int x, int y )
+    {
+      ++count_; x_total += x; y_total += y;
+      extend(x, y, x, y);
+    }
+
+    // add the pixels start to end-1 of a row in one go
+    void add_run( int y, int start, int end )
+    {
+      int length = end - start;
+
+      count_  += length;
+      x_total += (start + end - 1) * length / 2;
+      y_total += y * length;
+
+      extend(start, y, end-1, y);
+    }
+
+    // move the region, e.g. from the coordinates of a window to those of the full image
+    void translate( int dx, int dy )
+    {
+      x_total += dx * count_;
+      y_total += dy * count_;
+
+      min_x += dx; max_x += dx;
+      min_y += dy; max_y += dy;
+    }
+
+    // some 'getters'
+    const int &count() const { return count_; }
+
+    // the centre is the average of the x and y values of all the pixels in the region
+    cv::Point2d centre() const { return cv::Point2d( (double)x_total/count_, (double)y_total/count_ ); }
+
+    // bounding box of the pixels in the region
+    cv::Rect bounds() const { return cv::Rect( min_x, min_y, max_x-min_x+1, max_y-min_y+1 ); }
+
+    // operator overload for combining regions
+    Region& operator+=(const Region& other)
+    {
+      count_ += other.count_;
+      x_total += other.x_total;
+      y_total += other.y_total;
+
+      extend(other.min_x, other.min_y, other.max_x, other.max_y);
+      return *this;
+    }
+
+  private:
+    void extend( int x0, int y0, int x1, int y1 )
+    {
+      min_x = std::min(min_x, x0); max_x = std::max(max_x, x1);
+      min_y = std::min(min_y, y0); max_y = std::max(max_y, y1);
+    }
+
+    int count_;
+    int x_total;
+    int y_total;
+
+    int min_x, min_y;
+    int max_x, max_y;
+};
+
+
+/**
+ * Run based connected component labeling. Each row of a classified image is added as a list of
+ * runs of foreground pixels, runs are joined with the overlapping runs of the previous row
+ * (4 connectivity) using union-find with path compression. Memory scales with the number of runs
+ * rather than the image size and there is no limit on the number of regions.
+ *
+ * Unlike the original per-pixel labeling, which only kept the lowest region each region was
+ * joined to, every join is kept - so shapes joined more than once come out as one region and
+ * the regions (and so the tracking) can differ from what the original found.
+ */
+class RunLabeler
+{
+  public:
+    /** A run of foreground pixels - columns start to end-1 of a row */
+    struct Run
+    {
+      int row;
+      int start;
+      int end;
+    };
+
+    RunLabeler() : prev_row_begin(0), row_begin(0), last_row(-2) {}
+
+    /** Start labeling a new image, the buffers are kept for reuse */
+    void reset();
+
+    /**
+     * Add the runs of set bits in a row of a packed bitmask (as made by SpotClassifier) and join
+     * them to the runs of the previous row if it was added last. Each run starts out with the
+     * totals of all its pixels. Returns the index of the first run added, the row's runs are from
+     * there up to run_count().
+     */
+    int add_row(int row, const SpotClassifier::MaskWord *mask, int cols);
+
+    int run_count() const { return runs.size(); }
+    const Run &run(int index) const { return runs[index]; }
+
+    /** The pixel totals of a run - these can be changed before resolve(), e.g. after refining */
+    Region &run_region(int index) { return run_regions[index]; }
+
+    /**
+     * Add all the runs of another labeler which labelled the rows straight after this one's (e.g.
+     * the next strip of the same image) and join them up across the seam. The result is the same
+     * as if all the rows had been added here.
+     */
+    void append(const RunLabeler &below);
+
+    /**
+     * Total up the connected runs, the distinct regions are appended to regions in the raster
+     * order of their first pixel. Regions left with no pixels are dropped.
+     */
+    void resolve(std::vector<Region> &regions);
+
+  private:
+    void add_run(int row, int start, int end);
+    void join_rows(int above, int above_end, int index, int index_end);
+
+    int find_root(int index);
+    void join(int a, int b);
+
+    std::vector<Run> runs;
+    std::vector<int> parent;            // union-find parent of each run
+    std::vector<Region> run_regions;    // pixel totals of each run
+
+    std::vector<int> root_region;       // scratch space for resolve()
+
+    int prev_row_begin;   // first run of the previous row
+    int row_begin;        // first run of the current row
+    int last_row;
+};
+
+
+/**
+ * Keep pointers to the largest of the regions in largest, as many as it has room for, smallest
+ * first. Any places left over point to the empty region.
+ */
+void largest_regions(const std::vector<Region> &regions, std::vector<const Region *> &largest, const Region *empty);
+
+#endif // REGIONLABELER_H
@@ -8,17 +8,32 @@
  *   (at your option) any later version.                                   *
  ***************************************************************************/
 
-#include <cassert>
 #include <iostream>
 #include <iomanip>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
 
 #include <opencv2/opencv.hpp>
 
-#include <dirent.h>
-#include <errno.h>
+#include <glob.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
+#include "framepool.h"
+#include "imageloader.h"
+#include "lenscorrection.h"
 #include "matfiledump.h"
+#include "spottracker.h"
+#include "spscqueue.h"
+#include "stagestats.h"
+#include "y4mreader.h"
 
 using namespace std;
 using namespace cv;
@@ -26,27 +41,48 @@ using namespace cv;
 
 /**--------------------------- Tunable Parameters ----------------------------*/
 
-//#define UNDISTORT_LENS
-#define INPUT_IS_FIELDS   /* define if input images are separated video fields rather than full frames */ 
-//#define WRITE_MAT_FILE
-//#define WRITE_IMAGES    /* good for creating a video of the result */
+// defaults for the options that can be changed on the command line or in a config file (-C)
+static const bool default_fields = true;     // input images are separated video fields rather than full frames
+static const int default_track_regions = 4;
+static const int default_start_file = 0;
 
-static const int num_track_regions = 4;
+// most times a second the display is updated, the tracking runs as fast as it can regardless
+static const int display_fps = 25;
 
-static const int start_file = 0;
+// live mode - fields queued for the tracking, older ones are dropped when it falls behind, and
+// the oldest a field can be when the tracking gets to it before it is dropped anyway (ms)
+static const int live_queue_depth = 2;
+static const double live_latency_budget = 30;
 
-static const int video_wait = 20;
+// keys waiting for the tracking to act on them
+static const int key_queue_depth = 16;
+
+// images handed to a batch thread at a time - with -w every batch_chunk images from the first
+// one tracked start with a full frame scan, with the display as well, so the output is the same
+static const int batch_chunk = 64;
+
+// memory (MB) for the tracked images batch mode holds for the video, shared by every thread
+// and input being tracked (-M) - nothing else it keeps is anywhere near as big
+static const int default_batch_memory = 1024;
+
+// seconds between the progress reports when tracking several inputs in batch mode
+static const int batch_progress_interval = 5;
+
+// memory for the decoded images kept around the one being shown, and results queued for writing
+static const size_t frame_cache_bytes = 256 << 20;
+static const int write_queue_depth = 16;
+
+// the video of the tracking - any codec the OpenCV build can encode, e.g. X264 with ffmpeg
+static const int video_fourcc = CV_FOURCC('M','J','P','G');
+static const double video_frame_rate = 25;   // doubled when the images are fields
 
 // opencv sub-pixel rendering uses fixed point arithmetic, this is the shift used
 static const int shift = 10;
 static const int shift_mult = 1<<shift;
 
-// not exactly a parameter, but needs to be tuned anyway
-inline bool is_tracking_spot(uchar * const &pixel)
-{
-  // loaded image format is BGR, so pixel[0] is blue, pixel[1] is green and pixel[2] is red
-  return pixel[1] < 210 && pixel[2] > (int)pixel[0]-5 && pixel[2] > (int)pixel[1]+10;
-}
+// not exactly a parameter, but needs to be tuned anyway - a pixel is part of a tracking spot if
+// green < 210 && red > blue-5 && red > green+10 (max_green, blue_margin and green_margin)
+static const SpotThresholds default_thresholds = { 210, 5, 10 };
 
 
 /**---------------------------------------------------------------------------*/
@@ -56,470 +92,1966 @@ inline bool is_tracking_spot(uchar * const &pixel)
 bool highest_point( Point2d p1, Point2d p2 ) { return p1.y < p2.y; }
 
 
+/** The options the spots are tracked with */
+struct TrackOptions
+{
+  bool fields;          // the images are separated video fields rather than full frames
+  int regions;          // spots to track, the leg is made from the four highest
+  SpotThresholds thresholds;
+
+  bool chroma_planes;   // classify on the subsampled chroma planes of stream input
+  bool windowed;        // follow the spots with prediction windows instead of scanning every frame
+  int pyramid_factor;   // decimation for the coarse search, 1 to label full frames
+  int strips;           // most strips to label an image in parallel, 1 for none
+  bool split_frames;    // the ppm images are interlaced frames, tracked as their two fields
+
+  const LensCorrection *lens;   // undistorts the track points, NULL to leave them as they are
+  const SpotColourTable *colour_table;   // spot colours to use instead of the thresholds, or NULL
+
+  void apply(SpotTracker &tracker) const
+  {
+    tracker.set_windowed(windowed);
+    tracker.set_pyramid_factor(pyramid_factor);
+    tracker.set_strips(strips);
+  }
+};
+
 
-/** Class to load the images and correct the lens distortion */
-class ImageLoader
+/** What a run writes and which images it starts from */
+struct RunOptions
 {
-  private:
-    string &dir;
+  int start_file;       // first image tracked
+  bool write_mat;       // write the tracking to <input>_tracking.mat
+  bool write_video;     // encode the tracked images into <input>_tracking.avi
+  bool undistort;       // correct the lens distortion of the track points with calib.xml
+  string colour_table;  // file to load the spot colour table from, empty to use the thresholds
+  int batch_memory;     // MB for the images batch mode holds for the video
+  int raw_width;        // size of the frames of a headerless 4:2:0 live stream, 0 for YUV4MPEG2
+  int raw_height;
+};
+
+
+
+/**
+ * Track a loaded image - the centres of the spots are put into track_points in full frame
+ * coordinates, sorted by their y-values. field_parity is the lines of the frame a field came
+ * from (see ImageLoader::field_parity), -1 for full frames. The display mask is filled in unless it is empty.
+ * Returns the number of distinct regions found.
+ */
+int track_image(SpotTracker &tracker, int file_num, int field_parity, const TrackFrame &frame,
+                Mat &display_mask, vector<Point2d> &track_points)
+{
+  if( !display_mask.empty() )
+    display_mask.setTo(Scalar::all(255));
+
+  int distinct_region_count = tracker.track(file_num, frame, display_mask, track_points);
+
+  // move the track points from field lines to frame lines
+  if( field_parity >= 0 )
+  {
+    for( size_t index=0; index<track_points.size(); ++index )
+      track_points[index].y = track_points[index].y*2 + field_parity;
+  }
+
+  // sort the track_points by their y-values - this is an easy way to distinguish the points
+  sort( track_points.begin(), track_points.end(), highest_point ); 
+
+  return distinct_region_count;
+}
+
+
+/**
+ * Get a copy of an image to draw the tracking on, at full frame size. Only done for the images
+ * that are actually shown or encoded.
+ */
+Mat overlay_image(const Mat &image, bool fields)
+{
+  Mat overlay;
+
+  // rescale a video field to full frame size so we can display the tracking points nicely
+  if( fields )
+    resize(image, overlay, Size(), 1, 2);
+  else
+    overlay = image.clone();   // don't draw on the loaded image, it may be tracked again
+
+  return overlay;
+}
+
+
+/** Draw the leg on the image, the track points must be sorted by their y-values */
+void draw_tracking(Mat &image, vector<Point2d> track_points)
+{
+  // average the top to points to get the centre of the upper part of the leg
+  Point2d leg_centre = (track_points[0] + track_points[1]) * 0.5;
+
+  // apply shift multiplier to points for sub-pixel rendering
+  leg_centre *= shift_mult;
+  track_points[0] *= shift_mult;
+  track_points[1] *= shift_mult;
+  track_points[2] *= shift_mult;
+  track_points[3] *= shift_mult;
+
+  // draw lines on each part of the leg in green, 2 pixels thick
+  line(image, leg_centre, track_points[2], CV_RGB(0, 255, 0), 2, CV_AA, shift);
+  line(image, track_points[2], track_points[3], CV_RGB(0, 255, 0), 2, CV_AA, shift);
+
+  // centre of top of leg in blue, 2 pixels thick
+  circle(image, leg_centre, 5*shift_mult, CV_RGB(0, 0, 255), CV_FILLED, CV_AA, shift);
+
+  // all the track points in black, 5 pixel diameter
+  circle(image, track_points[0], 5*shift_mult, CV_RGB(0, 0, 0), CV_FILLED, CV_AA, shift);
+  circle(image, track_points[1], 5*shift_mult, CV_RGB(0, 0, 0), CV_FILLED, CV_AA, shift);
+  circle(image, track_points[2], 5*shift_mult, CV_RGB(0, 0, 0), CV_FILLED, CV_AA, shift);
+  circle(image, track_points[3], 5*shift_mult, CV_RGB(0, 0, 0), CV_FILLED, CV_AA, shift);
+}
+
+
+// variables in the .mat output, one column per image
+enum OutputVariable
+{
+  OUT_DATA_ARRAY,      // leg centre, joint and lower leg x,y
+  OUT_REGION_COUNTS,   // distinct regions found
+  OUT_WARNINGS,        // 1 if too few regions were found to track all the spots
+  OUT_IMAGE_NUMBERS    // the image tracked, images can be dropped in live mode
+};
+
+
+/** The leg from the track points, the rows of data_array - the track points must be sorted */
+void leg_column(const vector<Point2d> &track_points, double column[6])
+{
+  // average the top to points to get the centre of the upper part of the leg
+  Point2d leg_centre = (track_points[0] + track_points[1]) * 0.5;
+
+  // centre of upper part of leg
+  column[0] = leg_centre.x;
+  column[1] = leg_centre.y;
+
+  // joint
+  column[2] = track_points[2].x;
+  column[3] = track_points[2].y;
 
-    Mat image_orig;
+  // lower part of leg
+  column[4] = track_points[3].x;
+  column[5] = track_points[3].y;
+}
+
+
+/**
+ * Check the spots were all found and write the tracking of an image to the output, if it is
+ * open. A warning is printed if they weren't unless print_warning is cleared, it is written to
+ * the output regardless.
+ */
+void write_result(MatFileDump &outfile, int file_num, int distinct_region_count, const vector<Point2d> &track_points,
+                  bool print_warning=true)
+{
+  // check we found the number of regions we were looking for
+  bool warning = distinct_region_count < (int)track_points.size();
+  if( warning && print_warning )
+    cerr << "Warning: Only found " << distinct_region_count << " regions in " << ImageLoader::file_num_to_name(file_num) << endl;
+
+  if( !outfile.isOpen() )
+    return;
+
+  double column[6];
+  leg_column(track_points, column);
+
+  outfile.writeColumn(OUT_DATA_ARRAY, column);
+  outfile.writeDouble(OUT_REGION_COUNTS, distinct_region_count);
+  outfile.writeDouble(OUT_WARNINGS, warning ? 1 : 0);
+  outfile.writeDouble(OUT_IMAGE_NUMBERS, file_num);
+}
 
-#ifdef UNDISTORT_LENS
-    Mat image_undist;
-    Mat map1, map2;
-#endif
 
+
+/**
+ * Batch tracking on a pool of threads, each with its own loader and tracker. Images are handed
+ * out batch_chunk at a time so each tracker still sees runs of consecutive images, and the
+ * results are passed back in image order. Each chunk is tracked from scratch - with -w it
+ * starts with a full scan whichever thread gets it and whatever that thread tracked before -
+ * so the output is the same for any number of threads. The run with the display starts again
+ * at the same images, so it gives the same output too.
+ */
+class BatchTracker
+{
   public:
-    ImageLoader(string &dir) :
-      dir(dir)
+    /** The tracking is drawn on each image for the video if draw is set */
+    BatchTracker(const string &path, const TrackOptions &options, int first_file, int end_file, bool draw) :
+      full_scans(0),
+      coarse_scans(0),
+      kernel_name(""),
+      path(path),
+      options(options),
+      draw(draw),
+      first_file(first_file),
+      end_file(end_file),
+      next_chunk(first_file),
+      next_take(first_file),
+      images_ahead(0),
+      results(end_file - first_file)
     {
-#ifdef UNDISTORT_LENS
-      FileStorage calib("calib.xml", FileStorage::READ);
+    }
 
-      if( !calib.isOpened() )
-      {
-        cerr << "Error: Failed opening calib.xml" << endl;
-        exit(-1);
-      }
+    /** images_kept is the most tracked images to hold for the video at once */
+    void start(int thread_count, int images_kept)
+    {
+      images_ahead = min( thread_count * batch_chunk * 2, max(images_kept, 1) );
+
+      for( int index=0; index<thread_count; ++index )
+        threads.push_back( thread(&BatchTracker::run, this) );
+    }
 
-      Mat cam_matrix, dist_coeff;
-      calib["Camera_Matrix"]           >> cam_matrix;
-      calib["Distortion_Coefficients"] >> dist_coeff;
+    /** Wait for an image to be tracked, the results must be taken in order */
+    void take(int file_num, int &distinct_region_count, vector<Point2d> &track_points, Mat &image)
+    {
+      Result &result = results[file_num - first_file];
+
+      unique_lock<mutex> lock(results_mutex);
+      result_ready.wait( lock, [&result]{ return result.done; } );
+
+      distinct_region_count = result.distinct_region_count;
+      track_points.swap(result.track_points);
+      vector<Point2d>().swap(result.track_points);   // free it, the run could be long
+
+      image = result.image;
+      result.image.release();
 
-      initUndistortRectifyMap(
-          cam_matrix,
-          dist_coeff,
-          Mat(),
-          getOptimalNewCameraMatrix(cam_matrix, dist_coeff, Point(512, 384), 1, Point(512, 384), 0),
-          Point(512, 384),
-          CV_16SC2,
-          map1,
-          map2
-          );
-#endif
+      next_take = file_num+1;
+      result_taken.notify_all();
     }
 
-    static inline string file_num_to_name(int file_num)
+    void join()
     {
-      ostringstream num_convert;
-      num_convert << setw(8) << setfill('0') << file_num << ".ppm";
-      return num_convert.str();
+      for( size_t index=0; index < threads.size(); ++index )
+        threads[index].join();
     }
 
-    /** Count xxxxxxxx.ppm files in directory */
-    static int count_ppm(const char *path)
+    // totals over all the threads, once they are joined
+    int full_scans;
+    int coarse_scans;
+    const char *kernel_name;
+
+  private:
+    struct Result
     {
-      int file_count = 0;
-      DIR *dir;
-      struct dirent *entry;
+      Result() : done(false), distinct_region_count(0) {}
 
-      if( (dir = opendir(path)) == NULL )
-        return -1;
+      bool done;
+      int distinct_region_count;
+      vector<Point2d> track_points;
+      Mat image;   // tracked image for the video, if it is drawn
+    };
+
+    void run()
+    {
+      ImageLoader image_loader(path, options.fields, options.split_frames);
+
+      SpotTracker tracker(options.regions, options.thresholds, options.chroma_planes, options.colour_table);
+      options.apply(tracker);
 
-      errno = 0;
+      TrackFrame frame;
+      Mat no_display_mask;
+      vector<Point2d> track_points;
 
-      while( (entry = readdir(dir)) != NULL )
+      for( int chunk_start; (chunk_start = next_chunk.fetch_add(batch_chunk)) < end_file; )
       {
-        if( entry->d_type == DT_REG                 // regular file
-            && strlen(entry->d_name) == 12          // files are 8 digits plus .ppm extension
-            && strcmp(entry->d_name+8, ".ppm") == 0 )
+        // the tracked images are kept until they are taken, don't get too far ahead of the writing
+        if( draw )
         {
-          ++file_count;
+          unique_lock<mutex> lock(results_mutex);
+          result_taken.wait( lock, [&]{ return chunk_start < next_take + images_ahead; } );
         }
-      }
 
-      // check the end of the directory was actually reached without error
-      if( errno != 0 )
-        file_count = -1;
+        // forget the spots of the last chunk this thread tracked, it may not have been the one before
+        tracker.set_windowed(options.windowed);
 
-      closedir(dir);
+        for( int file_num = chunk_start; file_num < min(chunk_start + batch_chunk, end_file); ++file_num )
+        {
+          image_loader.load_frame(file_num, options.chroma_planes, frame);
 
-      return file_count;
-    }
+          int distinct_region_count = track_image(tracker, file_num, image_loader.field_parity(file_num), frame, no_display_mask, track_points);
 
-    Mat &load_image(int file_num)
-    {
-      string file_name = dir + file_num_to_name(file_num);
+          Mat image;
+          if( draw )
+          {
+            // the BGR image isn't loaded when tracking on the chroma planes
+            Mat bgr = frame.bgr;
+            if( bgr.empty() )
+              image_loader.load_image(file_num, bgr);
+
+            StageTimer timer(STAGE_DRAW);
+            image = overlay_image(bgr, options.fields);
+            draw_tracking(image, track_points);
+          }
 
-      // load the image or exit
-      image_orig = imread( file_name );
-      if( image_orig.data == 0 )
-      {
-        cerr << "Error: Couldn't find " << file_name << endl;
-        exit(-1);
-      }
+          // the output is undistorted, the drawing is on the raw image
+          if( options.lens != NULL )
+            options.lens->undistort(track_points);
 
-#ifdef UNDISTORT_LENS
-      remap(image_orig, image_undist, map1, map2, INTER_LINEAR);  // correct lens distortion
+          Result &result = results[file_num - first_file];
+
+          lock_guard<mutex> lock(results_mutex);
+          result.distinct_region_count = distinct_region_count;
+          result.track_points = track_points;
+          result.image = image;
+          result.done = true;
+          result_ready.notify_all();
+        }
+      }
 
-      return image_undist;
-#else
-      return image_orig;
-#endif
+      lock_guard<mutex> lock(results_mutex);
+      full_scans += tracker.full_scans();
+      coarse_scans += tracker.coarse_scans();
+      kernel_name = tracker.classifier().kernel_name();
     }
+
+    string path;
+    TrackOptions options;
+    bool draw;
+
+    int first_file;
+    int end_file;
+    atomic<int> next_chunk;
+
+    int next_take;      // next image to be taken
+    int images_ahead;   // how far past it the threads can get with images to keep
+
+    vector<thread> threads;
+
+    vector<Result> results;
+    mutex results_mutex;
+    condition_variable result_ready;
+    condition_variable result_taken;
 };
 
 
-/** Class to keep track of the regions found when doing connected component labelling **/
-class Region
+
+/**
+ * Ring of decoded images around the one being shown, filled on its own thread so playing,
+ * stepping and going back don't wait on reading and decoding. Most of the ring is kept ahead in
+ * the direction the images are being asked for and the rest behind, image n lives in slot
+ * n % capacity so moving along only replaces the images that drop out of the other end. The BGR
+ * image is always loaded, it is needed for the display even when tracking on the planes.
+ */
+class FrameCache
 {
   public:
-    Region() {}                     // stops initialisation of the full array of regions
-    Region(int dud) : count_(0) {}  // for empty region
+    FrameCache(const string &path, const TrackOptions &options, int first_file, int end_file, int capacity) :
+      path(path),
+      chroma_planes(options.chroma_planes),
+      fields(options.fields),
+      split_frames(options.split_frames),
+      first_file(first_file),
+      end_file(end_file),
+      position(first_file),
+      direction(1),
+      stop(false),
+      slots( max(min(capacity, end_file - first_file), 1) )
+    {
+      loader = thread(&FrameCache::run, this);
+    }
+
+    ~FrameCache()
+    {
+      {
+        lock_guard<mutex> lock(cache_mutex);
+        stop = true;
+      }
 
-    Region(int x, int y) : count_(1), x_total(x), y_total(y), lowest_equivalence(65535) {}
+      cache_changed.notify_all();
+      loader.join();
+    }
 
-    // keep a total of all the x and y values of pixels in a region - the centre is the average of these points
-    void add_point( int x, int y ) { ++count_; x_total += x; y_total += y; }
+    int capacity() const { return slots.size(); }
 
-    // only need to keep track of the lowest equivalent for a region
-    void set_equivalence( int region ) { if( region < lowest_equivalence ) lowest_equivalence = region; }
+    /** Get a loaded image, waiting for it if it isn't ready yet */
+    void get(int file_num, TrackFrame &frame)
+    {
+      Slot &slot = slots[file_num % slots.size()];
 
-    // some 'getters'
-    const int &equivalence() const { return lowest_equivalence; }
-    const int &count() const { return count_; }
+      unique_lock<mutex> lock(cache_mutex);
 
-    // the centre is the average of the x and y values of all the pixels in the region
-    Point2d centre() const { return Point2d( (double)x_total/count_, (double)y_total/count_ ); }
+      if( file_num != position )
+        direction = file_num > position ? 1 : -1;
 
-    // operator overload for combining regions
-    Region& operator+=(Region& other)
-    {
-      count_ += other.count_;
-      x_total += other.x_total;
-      y_total += other.y_total;
-      return *this;
+      position = file_num;
+      cache_changed.notify_all();
+
+      cache_changed.wait( lock, [&]{ return slot.file_num == file_num && slot.ready; } );
+      frame = slot.frame;
     }
 
   private:
-    int count_;
-    int x_total;
-    int y_total;
+    struct Slot
+    {
+      Slot() : file_num(-1), ready(false) {}
 
-    int lowest_equivalence;
-};
+      int file_num;   // image in the slot, or being loaded into it
+      bool ready;
+      TrackFrame frame;
+    };
 
+    /** The nearest image to the position that isn't in the ring yet (lock held), -1 if none */
+    int next_missing() const
+    {
+      int size = slots.size();
+      int behind = size / 4;
 
+      // the range of images the ring holds, kept within the input
+      int low = direction > 0 ? position - behind : position + behind - size + 1;
+      low = max( first_file, min(low, end_file - size) );
+      int high = low + size;
 
-/** @function main */
-int main( int argc, char** argv )
-{
-  // set up video directory related stuff
-  char *c_str;
+      // the position, then ahead, then behind
+      for( int file_num = position; file_num >= low && file_num < high; file_num += direction )
+        if( slots[file_num % size].file_num != file_num )
+          return file_num;
 
-  if( argc >= 2 )
-    c_str = realpath(argv[1], NULL);
-  else
-    c_str = realpath("./", NULL);
+      for( int file_num = position - direction; file_num >= low && file_num < high; file_num -= direction )
+        if( slots[file_num % size].file_num != file_num )
+          return file_num;
 
-  if( c_str == NULL )
-  {
-    cerr << "Error: Failed looking up input directory" << endl;
-    return -1;
-  }
+      return -1;
+    }
 
-  string in_dir(c_str);
+    void run()
+    {
+      ImageLoader image_loader(path, fields, split_frames);
+      image_loader.set_buffer_limit(slots.size() + 3);   // the ring, the images tracked and shown and the one loading
 
-  if( *in_dir.rbegin() != '/')   // don't trust realpath to be consistent with trailing slash
-    in_dir += '/';
+      unique_lock<mutex> lock(cache_mutex);
 
-  free(c_str);
+      while( !stop )
+      {
+        int file_num = next_missing();
+        if( file_num < 0 )
+        {
+          cache_changed.wait(lock);
+          continue;
+        }
 
-  // count the image files
-  int file_count = ImageLoader::count_ppm( in_dir.c_str() );
-  if( file_count < 0 )
-  {
-    cerr << "Error: Failed counting .ppm files" << endl;
-    return -1;
-  }
-  else if( file_count == 0 )
-  {
-    cerr << "Error: No .ppm files found in " << in_dir << endl;
-    return -1;
-  }
+        Slot &slot = slots[file_num % slots.size()];
+        slot.file_num = file_num;
+        slot.ready = false;
 
-  ImageLoader image_loader(in_dir);
+        lock.unlock();
 
-  Mat image = image_loader.load_image(start_file); // use parameters from the first image to initialise the masks
-  Mat display_mask(image.size(), image.type());    // mask to display
-  Mat region_mask(image.size(), CV_16UC1);         // mask to keep track of connected component regions
+        // each image gets its own buffers, the one replaced may still be in use
+        TrackFrame loaded;
+        image_loader.load_frame(file_num, chroma_planes, loaded);
+        if( loaded.bgr.empty() )
+          image_loader.load_image(file_num, loaded.bgr);
 
-#ifdef WRITE_MAT_FILE
-  // create the output .mat file
-  size_t base_index = in_dir.rfind( '/', in_dir.length()-2 ) + 1;     // -1 + 1 if not found
-  string base( in_dir.substr( base_index, in_dir.length()-(1+base_index) ) );
-  string outfile_name( base + "_tracking.mat" );
+        lock.lock();
 
-  QString q_outfile_name = QString::fromStdString(outfile_name); 
-  if( QFile::exists(q_outfile_name) )
-  {
-    cerr << outfile_name << " exists already, skipping" << endl;
-    return -1;
-  }
+        // the slot may have been given to another image while this one was loading
+        if( slot.file_num == file_num )
+        {
+          slot.frame = loaded;
+          slot.ready = true;
+          cache_changed.notify_all();
+        }
+      }
+    }
 
-  MatFileDump outfile( 6, q_outfile_name );
-#endif
+    string path;
+    bool chroma_planes;
+    bool fields;
+    bool split_frames;
+    int first_file;
+    int end_file;
 
-  // create main tracking window
-  namedWindow(in_dir);
-  cvMoveWindow(in_dir.c_str(), 600, 0);
+    int position;    // image last asked for
+    int direction;   // 1 if the images are being asked for forwards, -1 backwards
+    bool stop;
 
-  // window for the mask
-  namedWindow("mask");
-  cvMoveWindow("mask", 600, 500);
+    vector<Slot> slots;
+    mutex cache_mutex;
+    condition_variable cache_changed;
 
-#ifdef WRITE_IMAGES
-  cerr << "Warning: Writing tracked images to output directory" << endl;
-#endif
+    thread loader;
+};
 
-  Region regions[65534];   // array for all regions found
 
-  Region *large_regions[num_track_regions];  // pointers for the largest distinct regions
-  Region empty_region(0);
+/**
+ * The tracking of each image, kept as the images are tracked so going back a frame shows what
+ * was found instead of tracking it again. Results are handed on for writing in image order,
+ * each as soon as all the images before it have been tracked.
+ */
+class ResultStore
+{
+  public:
+    ResultStore(int first_file, int end_file) :
+      first_file(first_file),
+      next_write(first_file),
+      results(end_file - first_file)
+    {
+    }
 
-  bool pause = false;
+    bool has(int file_num) const { return results[file_num - first_file].distinct_region_count >= 0; }
 
-  /** Do the tracking - loop over all the image files */
-  for( int file_num = start_file, end_file = file_count-start_file; file_num < end_file; )
-  {
-    int region_count = 0;
+    void add(int file_num, int distinct_region_count, const vector<Point2d> &track_points)
+    {
+      Result &result = results[file_num - first_file];
+      result.distinct_region_count = distinct_region_count;
+      result.track_points = track_points;
+    }
 
-    image = image_loader.load_image(file_num); // first image loaded twice
+    int distinct_region_count(int file_num) const { return results[file_num - first_file].distinct_region_count; }
+    const vector<Point2d> &track_points(int file_num) const { return results[file_num - first_file].track_points; }
+
+    /** The next image to write, or -1 if it hasn't been tracked yet */
+    int next_to_write()
+    {
+      if( next_write - first_file >= (int)results.size() || !has(next_write) )
+        return -1;
 
+      return next_write++;
+    }
 
-    // loop through the image and do an adaption of 4 connected component labeling -
-    // http://en.wikipedia.org/wiki/Connected-component_labeling
-    for( int row=0; row < image.rows; ++row )
+  private:
+    struct Result
     {
-      // create row pointers into image and mask
-      uchar  *image_ptr         = image.ptr(row);
-      uchar  *display_mask_ptr  = display_mask.ptr(row);
+      Result() : distinct_region_count(-1) {}
 
-      ushort *region_mask_ptr   = region_mask.ptr<ushort>(row);
+      int distinct_region_count;   // -1 until the image is tracked
+      vector<Point2d> track_points;
+    };
 
-      // loop columns
-      for( int col=0; col < image.cols; ++col )
-      {
-        if( is_tracking_spot(image_ptr) ) // assumes BGR
-        {
-          // pixel deemed to be part of a tracking spot
+    int first_file;
+    int next_write;
 
-          // above and left regions - use 65535 if we are at the edge of the image
-          ushort region_above = (row==0) ? (65535) : (region_mask_ptr[ -region_mask.step1() ]);
-          ushort region_left  = (col==0) ? (65535) : (region_mask_ptr[-1]);
+    vector<Result> results;
+};
 
-          ushort min_connected = min( region_above, region_left );
 
-          if( min_connected < 65535 )
-          {
-            // pixel is connected to a previously found region
-            
-            *region_mask_ptr = min_connected;
+/**
+ * Writes the results on its own thread - the .mat output and the video of the tracked images -
+ * so the tracking never waits on encoding or the disk. Everything queued is written before it
+ * is destroyed. No video is written if the video name is empty.
+ */
+class ResultWriter
+{
+  public:
+    /** Images missing spots are warned about unless print_warnings is cleared, e.g. when they are counted instead */
+    ResultWriter(MatFileDump &outfile, const string &video_name="", double video_fps=0, bool print_warnings=true) :
+      outfile(outfile),
+      video_name(video_name),
+      video_fps(video_fps),
+      print_warnings(print_warnings),
+      results(write_queue_depth)
+    {
+      writer = thread(&ResultWriter::run, this);
+    }
 
+    ~ResultWriter()
+    {
+      Result last;   // file_num of -1 to finish
+      results.push(last);
+      writer.join();
+    }
 
-            regions[min_connected].add_point(col, row);
+    void write(int file_num, int distinct_region_count, const vector<Point2d> &track_points, const Mat &image)
+    {
+      Result result;
+      result.file_num = file_num;
+      result.distinct_region_count = distinct_region_count;
+      result.track_points = track_points;
+      result.image = image;
 
-            ushort max_connected = max( region_above, region_left );
+      results.push(result);
+    }
 
-            // if pixel is connected to another region, set its equivalence to the one with the lower index
-            if( max_connected < 65535 && max_connected != min_connected )
-              regions[max_connected].set_equivalence(min_connected);
-          }
-          else
-          {
-            // pixel not connected to a previously found region - add a new one to the array
+  private:
+    struct Result
+    {
+      Result() : file_num(-1), distinct_region_count(0) {}
 
-            if( region_count >= 65535 )
-            {
-              cerr << "Error: Exceeded maximum regions" << endl;
-              return -1;
-            }
+      int file_num;
+      int distinct_region_count;
+      vector<Point2d> track_points;
+      Mat image;   // tracked image for the video, if it is drawn
+    };
 
-            regions[region_count] = Region(col, row);
-            *region_mask_ptr = region_count++;
-          }
+    void run()
+    {
+      Result result;
 
-          // display the colours of pixels deemed to be part of the tracking spot - useful for tuning
-          display_mask_ptr[0] = image_ptr[0];
-          display_mask_ptr[1] = image_ptr[1];
-          display_mask_ptr[2] = image_ptr[2];
-        }
-        else
+      for( results.pop(result); result.file_num >= 0; results.pop(result) )
+      {
         {
-          // pixel not deemed to be part of a tracking spot
+          StageTimer timer(STAGE_MAT_WRITE);
+          write_result(outfile, result.file_num, result.distinct_region_count, result.track_points, print_warnings);
+        }
 
-          *region_mask_ptr = 65535;
+        if( video_name.empty() || result.image.empty() )   // live mode doesn't draw the tracking
+          continue;
 
-          display_mask_ptr[0] = 255;
-          display_mask_ptr[1] = 255;
-          display_mask_ptr[2] = 255;
+        // the video is opened with the size of the first image
+        if( !video.isOpened() && !video.open(video_name, video_fourcc, video_fps, result.image.size()) )
+        {
+          cerr << "Error: Failed opening " << video_name << " for the video output" << endl;
+          exit(-1);
         }
 
-        // advance row pointers to the next column
-        image_ptr += 3;
-        display_mask_ptr += 3;
-
-        ++region_mask_ptr;
+        StageTimer timer(STAGE_IMAGE_WRITE);
+        video << result.image;
       }
     }
 
-    // (re)initialise the large region pointers
-    for( int index=0; index<num_track_regions; ++index )
-      large_regions[index] = &empty_region;
+    MatFileDump &outfile;
+
+    string video_name;
+    double video_fps;
+    VideoWriter video;
+
+    bool print_warnings;
+
+    SpscQueue<Result> results;
+    thread writer;
+};
+
 
-    int distinct_region_count = 0;
 
-    // Loop backward over the array of regions and add the necessary internal values of each
-    // region with an equivalent region (always lower) to the equivalent region. Once equivalent
-    // regions have been accounted for, we keep pointers to the largest distinct regions (which
-    // should be the ones we are looking for).
-    while( region_count-- )
+/**
+ * The windows and keys, run on the main thread while the tracking runs on its own so it never
+ * waits on drawing or on the keys being polled. The latest image from the tracking is shown, at
+ * most display_fps times a second, and the keys are passed back to the tracking through a
+ * queue. All the HighGUI calls are made from run().
+ */
+class Display
+{
+  public:
+    /** fields is set if the images are to be stretched back to the frame's shape */
+    Display(const string &window, bool fields) :
+      window(window),
+      fields(fields),
+      fresh(false),
+      finished(false),
+      keys(key_queue_depth)
+    {
+    }
+
+    /**
+     * Show an image with its tracking and mask next time the display is updated (tracking
+     * thread). The tracking is only drawn on the images that are shown.
+     */
+    void show(const Mat &image, const vector<Point2d> &track_points, const Mat &mask)
     {
-      Region &region = regions[region_count];
+      lock_guard<mutex> lock(latest_mutex);
 
-      if( region.equivalence() < 65535 )
-      {
-        // total equivalent regions
-        regions[region.equivalence()] += region;
-      }
-      else
+      latest_image = image;      // not drawn on, the drawing is on a copy
+      latest_points = track_points;
+      mask.copyTo(latest_mask);  // the mask is reused for the next image
+      fresh = true;
+    }
+
+    /** The next key pressed, or -1 if there isn't one (tracking thread) */
+    int poll_key()
+    {
+      int key;
+      return keys.try_pop(key) ? key : -1;
+    }
+
+    /** Wait for the next key to be pressed (tracking thread) */
+    int wait_key()
+    {
+      int key;
+      keys.pop(key);
+      return key;
+    }
+
+    /** Stop the display once the tracking is done */
+    void finish() { finished = true; }
+
+    /** Update the windows and pass on the keys until finish() is called */
+    void run()
+    {
+      // create main tracking window
+      namedWindow(window);
+      cvMoveWindow(window.c_str(), 600, 0);
+
+      // window for the mask
+      namedWindow("mask");
+      cvMoveWindow("mask", 600, 500);
+
+      Mat image;
+      vector<Point2d> track_points;
+      Mat mask;
+
+      while( !finished )
       {
-        ++distinct_region_count;
-        
-        // keep pointers to the largest regions - do a simple sorting adaption
-        if( region.count() > large_regions[0]->count() )
+        bool update;
+        {
+          lock_guard<mutex> lock(latest_mutex);
+
+          update = fresh;
+          if( update )
+          {
+            image = latest_image;
+            track_points.swap(latest_points);
+            swap(mask, latest_mask);   // the old one is copied over next, it's finished with
+            fresh = false;
+          }
+        }
+
+        if( update )
         {
-          int index=1;
-          for( ; index<num_track_regions; ++index )
           {
-            if( region.count() > large_regions[index]->count() )
-              large_regions[index-1] = large_regions[index];
-            else
-              break;
+            StageTimer timer(STAGE_DRAW);
+            image = overlay_image(image, fields);
+            draw_tracking(image, track_points);
           }
 
-          large_regions[index-1] = &region;
+          StageTimer timer(STAGE_DISPLAY);
+          imshow( window, image );
+          imshow( "mask", mask );
         }
+
+        // opencv need this to update display windows
+        int key = waitKey(1000 / display_fps);
+        if( key >= 0 )
+          keys.try_push(key);   // dropped if the tracking has fallen that far behind the keys
       }
     }
 
-    // check we found the number of regions we were looking for
-    if( distinct_region_count < num_track_regions )
-      cerr << "Warning: Only found " << distinct_region_count << " regions in " << ImageLoader::file_num_to_name(file_num) << endl;
+  private:
+    string window;
+    bool fields;
+
+    mutex latest_mutex;
+    Mat latest_image;
+    vector<Point2d> latest_points;
+    Mat latest_mask;
+    bool fresh;   // latest image not shown yet
+
+    atomic<bool> finished;
+
+    SpscQueue<int> keys;
+};
+
+
+
+/**
+ * Prints the time spent in each stage (see StageStats) every so many images if an interval is
+ * set, and at the end along with the CSV if a file name is set.
+ */
+class StatsReport
+{
+  public:
+    StatsReport() :
+      interval(0),
+      start_ticks(getTickCount())
+    {
+    }
+
+    /** Start timing the run from now */
+    void restart() { start_ticks = getTickCount(); }
 
-#ifdef INPUT_IS_FIELDS 
-    // rescale the video field to full frame size so we can display the tracking points nicely
-    resize(image, image, Size(), 1, 2);
-#endif
+    /** Call with the number of images done as each one is finished */
+    void image_done(int images)
+    {
+      if( interval > 0 && images % interval == 0 )
+        StageStats::report(cerr, images, seconds());
+    }
 
-    vector<Point2d> track_points(num_track_regions);
- 
-    // find the centres of the large regions - these are the track points
-    for( int index=0; index<num_track_regions; ++index )
+    void finish(int images)
     {
-      Point2d &track_point = track_points[index];
-      track_point = large_regions[index]->centre();
+      StageStats::report(cerr, images, seconds());
 
-#ifdef INPUT_IS_FIELDS   
-      track_point.y = track_point.y*2 + file_num%2;
-#endif
+      if( !csv_name.empty() )
+        StageStats::write_csv(csv_name, images, seconds());
     }
 
-    // sort the track_points by their y-values - this is an easy way to distinguish the points
-    sort( track_points.begin(), track_points.end(), highest_point ); 
+    int interval;      // images between reports, 0 for none until the end
+    string csv_name;   // empty for no CSV
 
-    // average the top to points to get the centre of the upper part of the leg
-    Point2d leg_centre = (track_points[0] + track_points[1]) * 0.5;
+  private:
+    double seconds() const { return (getTickCount() - start_ticks) / getTickFrequency(); }
 
-#ifdef WRITE_MAT_FILE
-    // centre of upper part of leg
-    outfile << leg_centre.x;
-    outfile << leg_centre.y;
+    int64 start_ticks;
+};
 
-    // joint
-    outfile << track_points[2].x;
-    outfile << track_points[2].y;
 
-    // lower part of leg
-    outfile << track_points[3].x;
-    outfile << track_points[3].y;
-#endif
+/**
+ * Reads a live stream on its own thread and hands the tracking the newest images. Only a few
+ * images are queued - when the tracking falls behind the oldest are dropped, and any that have
+ * waited longer than the latency budget are dropped when they are taken - so the tracking is
+ * always working on what the camera sees now rather than catching up.
+ */
+class LiveCapture
+{
+  public:
+    struct Image
+    {
+      Image() : file_num(-1), field_parity(0), arrival(0) {}
+
+      int file_num;       // counting fields if the frames are split into them
+      int field_parity;   // -1 for full frames
+      int64 arrival;      // tick count when the frame had been read
+
+      Mat buffer;         // the frame data, the planes are views into it
+      TrackFrame frame;
+    };
+
+    /** Each frame is split into its two fields if fields is set */
+    LiveCapture(Y4mStream &stream, bool fields) :
+      dropped(0),
+      stream(stream),
+      fields(fields),
+      finished(false),
+      pool(live_queue_depth + 2)
+    {
+      capture = thread(&LiveCapture::run, this);
+    }
 
-    // apply shift multiplier to points for sub-pixel rendering
-    leg_centre *= shift_mult;
-    track_points[0] *= shift_mult;
-    track_points[1] *= shift_mult;
-    track_points[2] *= shift_mult;
-    track_points[3] *= shift_mult;
+    /** Reads to the end of the stream */
+    ~LiveCapture()
+    {
+      capture.join();
+    }
 
-    // draw lines on each part of the leg in green, 2 pixels thick
-    line(image, leg_centre, track_points[2], CV_RGB(0, 255, 0), 2, CV_AA, shift);
-    line(image, track_points[2], track_points[3], CV_RGB(0, 255, 0), 2, CV_AA, shift);
+    /** Wait for the next image, false once the stream has ended and everything is taken */
+    bool take(Image &image)
+    {
+      unique_lock<mutex> lock(queue_mutex);
 
-    // centre of top of leg in blue, 2 pixels thick
-    circle(image, leg_centre, 5*shift_mult, CV_RGB(0, 0, 255), CV_FILLED, CV_AA, shift);
+      for(;;)
+      {
+        queue_changed.wait( lock, [this]{ return !queue.empty() || finished; } );
+        if( queue.empty() )
+          return false;
 
-    // all the track points in black, 5 pixel diameter
-    circle(image, track_points[0], 5*shift_mult, CV_RGB(0, 0, 0), CV_FILLED, CV_AA, shift);
-    circle(image, track_points[1], 5*shift_mult, CV_RGB(0, 0, 0), CV_FILLED, CV_AA, shift);
-    circle(image, track_points[2], 5*shift_mult, CV_RGB(0, 0, 0), CV_FILLED, CV_AA, shift);
-    circle(image, track_points[3], 5*shift_mult, CV_RGB(0, 0, 0), CV_FILLED, CV_AA, shift);
+        image = queue.front();
+        queue.pop_front();
 
-    // show image and display_mask
-    imshow( in_dir, image );
-    imshow( "mask", display_mask );
+        if( (getTickCount() - image.arrival) * 1000.0 / getTickFrequency() <= live_latency_budget )
+          return true;
 
-#ifdef WRITE_IMAGES
-    imwrite( "tracked_" + image_loader.file_num_to_name(file_num), image );
-#endif
+        ++dropped;   // too old to be worth tracking
+      }
+    }
 
-    // opencv need this to update display windows
-    char key = waitKey(video_wait);
+    // images that weren't tracked, only changes in take() once the stream has ended
+    int dropped;
 
-    // do some simple video player actions with the result
-    switch(key)
+  private:
+    void run()
     {
-      // quit
-      case 27:   // ESC
-      case 'q':
-        cerr << "User quit, processed " << file_num << '/' << file_count << " images" << endl;
-        return 0;
+      for( int frame_num = 0; ; ++frame_num )
+      {
+        // waiting for the frame to arrive isn't counted, only reading it once it has started
+        Mat buffer = pool.take(Size(stream.frame_bytes(), 1), CV_8UC1);
+        if( !stream.read_frame(buffer) )
+          break;
 
-      // toggle pause
-      case ' ':
-        pause ^= true;
-        break;
+        int64 arrival = getTickCount();
 
-      // advance frame (when paused)
-      case 'n':
-      case '.':
-      case '>':
-        if( file_num+1 < end_file )
-          ++file_num;
-        break;
+        Mat y, cb, cr;
+        stream.frame_planes(buffer, y, cb, cr);
 
-      // back frame (when paused)
-      case 'N':
-      case ',':
-      case '<':
-#ifndef WRITE_MAT_FILE
-        if( pause && file_num > start_file )
-          --file_num;
-        break;
-#else
-        // TODO - implement this properly so back skipping and writing the output do not need
-        // to be mutually exclusive
-        cerr << "WRITE_MAT_FILE must be undefined to enable backward skipping" << endl;
-        // **fall through**
-#endif
+        Image image;
+        image.arrival = arrival;
+        image.buffer = buffer;
 
-      default:
-        if( !pause )
-          ++file_num;
-        break;
+        if( !fields )
+        {
+          image.file_num = frame_num;
+          image.field_parity = -1;
+          image.frame.y = y;
+          image.frame.cb = cb;
+          image.frame.cr = cr;
+
+          push(image);
+          continue;
+        }
+
+        // both fields, in the order they were captured
+        for( int field = 0; field < 2; ++field )
+        {
+          image.file_num = frame_num*2 + field;
+          image.field_parity = field ^ (stream.bottom_field_first() ? 1 : 0);
+
+          image.frame.y  = field_lines(y,  image.field_parity);
+          image.frame.cb = field_lines(cb, image.field_parity);
+          image.frame.cr = field_lines(cr, image.field_parity);
+
+          push(image);
+        }
+      }
+
+      lock_guard<mutex> lock(queue_mutex);
+      finished = true;
+      queue_changed.notify_all();
     }
-  }
+
+    void push(const Image &image)
+    {
+      lock_guard<mutex> lock(queue_mutex);
+
+      if( (int)queue.size() >= live_queue_depth )
+      {
+        queue.pop_front();
+        ++dropped;
+      }
+
+      queue.push_back(image);
+      queue_changed.notify_all();
+    }
+
+    Y4mStream &stream;
+    bool fields;
+
+    deque<Image> queue;
+    mutex queue_mutex;
+    condition_variable queue_changed;
+    bool finished;
+
+    FramePool pool;   // only used on the capture thread
+    thread capture;
+};
+
+
+/**
+ * Track a live stream as it arrives. Each result is written to stdout as soon as it is known -
+ * the image number, the regions found, the six data_array values and the milliseconds since
+ * the frame was read - as well as to the usual output.
+ */
+static int track_live(const string &input, const TrackOptions &options, const RunOptions &run, MatFileDump &outfile,
+                      StatsReport &stats)
+{
+  Y4mStream stream;
+  if( run.raw_width > 0 ? !stream.open_raw(input, run.raw_width, run.raw_height) : !stream.open(input) )
+    return -1;
+
+  if( options.chroma_planes && stream.chroma_shift() == 0 )
+  {
+    cerr << "Error: -c needs a YUV4MPEG2 stream with subsampled chroma as input" << endl;
+    return -1;
+  }
+
+  if( options.lens != NULL && options.lens->image_size() != Size(stream.width(), stream.height()) )
+  {
+    cerr << "Error: calib.xml is for " << options.lens->image_size().width << 'x' << options.lens->image_size().height
+         << " images but the input is " << stream.width() << 'x' << stream.height() << endl;
+    return -1;
+  }
+
+  SpotTracker tracker(options.regions, options.thresholds, options.chroma_planes, options.colour_table);
+  options.apply(tracker);
+
+  ResultWriter writer(outfile);
+
+  int tracked = 0;
+  double total_latency = 0;
+  double max_latency = 0;
+
+  {
+    LiveCapture capture(stream, options.fields);
+    LiveCapture::Image image;
+
+    Mat bgr;   // reused, the last image has let go of it by the time the next is taken
+    Mat no_display_mask;
+    vector<Point2d> track_points;
+
+    while( capture.take(image) )
+    {
+      TrackFrame &frame = image.frame;
+      if( !options.chroma_planes )
+      {
+        StageTimer timer(STAGE_LOAD);
+        ycbcr_to_bgr(frame.y, frame.cb, frame.cr, bgr);
+        frame.bgr = bgr;
+      }
+
+      int distinct_region_count = track_image(tracker, image.file_num, image.field_parity, frame, no_display_mask, track_points);
+
+      if( options.lens != NULL )
+        options.lens->undistort(track_points);
+
+      double latency = (getTickCount() - image.arrival) * 1000.0 / getTickFrequency();
+
+      double column[6];
+      leg_column(track_points, column);
+
+      cout << image.file_num << ' ' << distinct_region_count;
+      for( int row=0; row<6; ++row )
+        cout << ' ' << column[row];
+      cout << ' ' << latency << endl;   // flushed, something may be waiting on it
+
+      writer.write(image.file_num, distinct_region_count, track_points, Mat());
+
+      ++tracked;
+      total_latency += latency;
+      max_latency = max(max_latency, latency);
+
+      stats.image_done(tracked);
+    }
+
+    cerr << "Tracked " << tracked << " images live, dropped " << capture.dropped << ", latency "
+         << fixed << setprecision(1) << total_latency / max(tracked, 1) << " ms mean, " << max_latency << " ms max" << endl;
+  }
+
+  stats.finish(tracked);
+
+  return 0;
+}
+
+
+
+/**
+ * Write a spot colour table generated from the thresholds, trained with the pixels marked in
+ * any sample images given. The samples are pairs of an image and a mask the same size, white
+ * in the mask marks spot pixels and black marks background - anything else isn't used, so only
+ * the pixels that matter need marking.
+ */
+static int make_colour_table(const string &table_name, const SpotThresholds &thresholds, int sample_count, char **samples)
+{
+  if( sample_count % 2 != 0 )
+  {
+    cerr << "Error: The samples for the colour table must be pairs of an image and its mask" << endl;
+    return -1;
+  }
+
+  SpotColourTable table(thresholds);
+  SpotColourTrainer trainer;
+
+  int spot_pixels = 0;
+  int background_pixels = 0;
+
+  for( int sample=0; sample < sample_count; sample += 2 )
+  {
+    Mat image = imread( samples[sample] );
+    Mat mask = imread( samples[sample+1], CV_LOAD_IMAGE_GRAYSCALE );
+
+    if( image.data == 0 || mask.data == 0 )
+    {
+      cerr << "Error: Couldn't load " << (image.data == 0 ? samples[sample] : samples[sample+1]) << endl;
+      return -1;
+    }
+
+    if( image.size() != mask.size() )
+    {
+      cerr << "Error: The mask " << samples[sample+1] << " isn't the same size as " << samples[sample] << endl;
+      return -1;
+    }
+
+    for( int row=0; row < image.rows; ++row )
+    {
+      const uchar *image_ptr = image.ptr(row);
+      const uchar *mask_ptr = mask.ptr(row);
+
+      for( int col=0; col < image.cols; ++col )
+      {
+        if( mask_ptr[col] == 255 )
+        {
+          trainer.add(image_ptr + 3*col, true);
+          ++spot_pixels;
+        }
+        else if( mask_ptr[col] == 0 )
+        {
+          trainer.add(image_ptr + 3*col, false);
+          ++background_pixels;
+        }
+      }
+    }
+  }
+
+  if( sample_count > 0 )
+    cerr << "Trained on " << spot_pixels << " spot and " << background_pixels << " background pixels, "
+         << trainer.cells_sampled() << " cells sampled and " << trainer.cells_changed(table) << " changed from the thresholds" << endl;
+
+  return trainer.train(table).save(table_name) ? 0 : -1;
+}
+
+
+
+static void usage(const char *prog)
+{
+  cerr << "Usage: " << prog << " [-C config] [-b] [-j threads] [-l] [-c] [-f] [-i] [-k thresholds] [-L table] [-m] [-n regions] [-p factor]" << endl
+       << "       [-r size] [-s strips] [-S image] [-t images] [-T file] [-u] [-v] [-w] [input directory or .y4m stream]" << endl
+       << "       " << prog << " -b [-j threads] [-M MB] [options] input ..." << endl
+       << "       " << prog << " [-k thresholds] -G table [image mask ...]" << endl
+       << "  -C  read the options from this config file (see tracking.xml), options after it override the file" << endl
+       << "  -b  batch mode - no display windows, track at full speed and report frames/s, of any number of inputs" << endl
+       << "  -j  number of threads to track with in batch mode, 0 for one per core (default 1, or one per core for" << endl
+       << "      several inputs - tracked that many at once)" << endl
+       << "  -l  live mode - track a y4m (or raw, see -r) stream from a pipe, FIFO or - for stdin as it arrives" << endl
+       << "  -c  find the spots on the 4:2:0 chroma planes of a stream " << endl
+       << "  -f  the images are full frames, not video fields" << endl
+       << "  -G  write a spot colour table made from the thresholds, trained with the pixels marked white (spot)" << endl
+       << "      or black (background) in the masks of any sample images, instead of tracking" << endl
+       << "  -i  the ppm images are interlaced frames, track each of their fields" << endl
+       << "  -k  spot colour thresholds max_green,blue_margin,green_margin (default "
+       << default_thresholds.max_green << ',' << default_thresholds.blue_margin << ',' << default_thresholds.green_margin << ')' << endl
+       << "  -L  find the spots with the colour table from this file (see -G) instead of the thresholds" << endl
+       << "  -m  write the tracking to <input>_tracking.mat" << endl
+       << "  -M  memory in MB for the tracked images batch mode holds for the video, over all the threads and inputs"
+       << " (default " << default_batch_memory << ')' << endl
+       << "  -n  number of spots to track, at least 4 (default " << default_track_regions << ')' << endl
+       << "  -p  find the spots coarse to fine, first in the image decimated by factor (2 or 4)" << endl
+       << "  -r  the live stream is raw 4:2:0 frames of this size, e.g. 512x384, with no y4m headers" << endl
+       << "  -s  label each image as this many strips in parallel, 0 for one per core (default 1)" << endl
+       << "  -S  image to start tracking from (default " << default_start_file << ')' << endl
+       << "  -t  print the time spent in each stage every this many images (always printed at the end)" << endl
+       << "  -T  write the stage times to this CSV file at the end" << endl
+       << "  -u  correct the lens distortion of the track points with calib.xml" << endl
+       << "  -v  encode the tracked images into <input>_tracking.avi (not in live mode)" << endl
+       << "  -w  only search windows around the predicted spot positions once they are found" << endl;
+}
+
+
+/** Read an integer setting from a config file if it is there, false if it isn't an integer */
+static bool config_value(const FileStorage &config, const string &file_name, const char *name, int &value)
+{
+  FileNode node = config[name];
+  if( node.empty() )
+    return true;
+
+  if( !node.isInt() )
+  {
+    cerr << "Error: " << name << " in " << file_name << " must be an integer" << endl;
+    return false;
+  }
+
+  value = (int)node;
+  return true;
+}
+
+
+/** Read a string setting from a config file if it is there */
+static bool config_value(const FileStorage &config, const string &file_name, const char *name, string &value)
+{
+  FileNode node = config[name];
+  if( node.empty() )
+    return true;
+
+  if( !node.isString() )
+  {
+    cerr << "Error: " << name << " in " << file_name << " must be a string" << endl;
+    return false;
+  }
+
+  value = (string)node;
+  return true;
+}
+
+
+/** Read a flag setting (0 or 1) from a config file if it is there */
+static bool config_value(const FileStorage &config, const string &file_name, const char *name, bool &value)
+{
+  int flag = value ? 1 : 0;
+  if( !config_value(config, file_name, name, flag) )
+    return false;
+
+  value = flag != 0;
+  return true;
+}
+
+
+/**
+ * Read the options set in a config file, an OpenCV FileStorage file like calib.xml (see
+ * tracking.xml). Anything the file doesn't set is left as it is.
+ */
+static bool read_config(const string &file_name, TrackOptions &options, RunOptions &run)
+{
+  FileStorage config(file_name, FileStorage::READ);
+
+  if( !config.isOpened() )
+  {
+    cerr << "Error: Failed opening " << file_name << endl;
+    return false;
+  }
+
+  // catch misspelt settings rather than silently running without them
+  static const char *const names[] = { "fields", "regions", "max_green", "blue_margin", "green_margin", "chroma_planes", "windowed",
+                                       "pyramid_factor", "strips", "start_file", "write_mat", "write_video", "undistort", "colour_table",
+                                       "batch_memory", "raw_width", "raw_height" };
+  const char *const *names_end = names + sizeof(names)/sizeof(names[0]);
+
+  FileNode root = config.root();
+  for( FileNodeIterator it = root.begin(); it != root.end(); ++it )
+  {
+    if( find(names, names_end, (*it).name()) == names_end )
+    {
+      cerr << "Error: Unknown setting " << (*it).name() << " in " << file_name << endl;
+      return false;
+    }
+  }
+
+  return config_value(config, file_name, "fields", options.fields)
+      && config_value(config, file_name, "regions", options.regions)
+      && config_value(config, file_name, "max_green", options.thresholds.max_green)
+      && config_value(config, file_name, "blue_margin", options.thresholds.blue_margin)
+      && config_value(config, file_name, "green_margin", options.thresholds.green_margin)
+      && config_value(config, file_name, "chroma_planes", options.chroma_planes)
+      && config_value(config, file_name, "windowed", options.windowed)
+      && config_value(config, file_name, "pyramid_factor", options.pyramid_factor)
+      && config_value(config, file_name, "strips", options.strips)
+      && config_value(config, file_name, "start_file", run.start_file)
+      && config_value(config, file_name, "write_mat", run.write_mat)
+      && config_value(config, file_name, "write_video", run.write_video)
+      && config_value(config, file_name, "undistort", run.undistort)
+      && config_value(config, file_name, "colour_table", run.colour_table)
+      && config_value(config, file_name, "batch_memory", run.batch_memory)
+      && config_value(config, file_name, "raw_width", run.raw_width)
+      && config_value(config, file_name, "raw_height", run.raw_height);
+}
+
+
+/** Name for the output, the input directory (with a trailing slash) or stream file without its extension */
+static string output_base(const string &input, bool is_dir)
+{
+  size_t base_index = input.rfind( '/', input.length()-2 ) + 1;     // -1 + 1 if not found
+  size_t base_end = input.length() - 1;                             // drop the trailing slash
+
+  if( !is_dir )
+  {
+    base_end = input.rfind( '.' );                                    // drop the extension
+    if( base_end == string::npos || base_end < base_index )
+      base_end = input.length();
+  }
+
+  return input.substr( base_index, base_end-base_index );
+}
+
+
+/** Create the output .mat file, false if it exists already */
+static bool open_outfile(MatFileDump &outfile, const string &base, int capacity)
+{
+  string outfile_name( base + "_tracking.mat" );
+
+  struct stat outfile_stat;
+  if( stat(outfile_name.c_str(), &outfile_stat) == 0 )
+  {
+    cerr << outfile_name << " exists already, skipping" << endl;
+    return false;
+  }
+
+  // room for every image up front, the output is written as the images are tracked
+  outfile.newFile( 6, outfile_name, capacity );
+  outfile.addVariable("region_counts", 1);
+  outfile.addVariable("warnings", 1);
+  outfile.addVariable("image_numbers", 1);
+
+  return true;
+}
+
+
+/** An input checked and ready to track */
+struct Input
+{
+  string path;        // with a trailing slash for a directory of ppm files
+  bool is_dir;
+  string base;        // the output is named after it, see output_base()
+  int start_file;     // the images tracked
+  int end_file;
+  Size frame_size;    // of the full frames, which the tracking is drawn on for the video
+};
+
+
+/**
+ * Expand the inputs given on the command line - any can be a pattern (quoted to keep it from
+ * the shell) matching several. False if one matches nothing.
+ */
+static bool expand_inputs(char **args, int count, vector<string> &inputs)
+{
+  for( int index=0; index<count; ++index )
+  {
+    glob_t matches;
+    if( glob(args[index], 0, NULL, &matches) != 0 )
+    {
+      cerr << "Error: Couldn't find " << args[index] << endl;
+      globfree(&matches);
+      return false;
+    }
+
+    for( size_t match=0; match < matches.gl_pathc; ++match )
+      inputs.push_back( matches.gl_pathv[match] );
+
+    globfree(&matches);
+  }
+
+  return true;
+}
+
+
+/** Look up an input and check it can be tracked with the options, false if it can't */
+static bool open_input(const string &arg, const TrackOptions &options, const RunOptions &run, Input &input)
+{
+  char *c_str = realpath(arg.c_str(), NULL);
+  if( c_str == NULL )
+  {
+    cerr << "Error: Failed looking up input " << arg << endl;
+    return false;
+  }
+
+  input.path = c_str;
+  free(c_str);
+
+  struct stat in_stat;
+  input.is_dir = stat(input.path.c_str(), &in_stat) == 0 && S_ISDIR(in_stat.st_mode);
+
+  if( input.is_dir && *input.path.rbegin() != '/')   // don't trust realpath to be consistent with trailing slash
+    input.path += '/';
+
+  if( options.split_frames && !input.is_dir )
+  {
+    cerr << "Error: -i is for a directory of ppm frames, streams are split into fields anyway" << endl;
+    return false;
+  }
+
+  ImageLoader image_loader(input.path, options.fields, options.split_frames);
+
+  // count the images
+  int file_count = image_loader.image_count();
+  if( file_count < 0 )
+  {
+    cerr << "Error: Failed counting .ppm files in " << input.path << endl;
+    return false;
+  }
+  else if( file_count == 0 )
+  {
+    cerr << "Error: No .ppm files found in " << input.path << endl;
+    return false;
+  }
+
+  // images are numbered from 0, tracking can start part way through
+  input.start_file = run.start_file;
+  input.end_file = file_count;
+
+  if( input.start_file >= input.end_file )
+  {
+    cerr << "Error: Can't start from image " << input.start_file << ", there are only " << file_count << " in " << input.path << endl;
+    return false;
+  }
+
+  if( options.chroma_planes && !image_loader.has_chroma_planes() )
+  {
+    cerr << "Error: -c needs a YUV4MPEG2 stream with subsampled chroma as input" << endl;
+    return false;
+  }
+
+  // the fields are put back into full frames for the output
+  input.frame_size = image_loader.load_image(input.start_file).size();
+  if( options.fields )
+    input.frame_size.height *= 2;
+
+  if( options.lens != NULL && input.frame_size != options.lens->image_size() )
+  {
+    cerr << "Error: calib.xml is for " << options.lens->image_size().width << 'x' << options.lens->image_size().height
+         << " images but " << input.path << " is " << input.frame_size.width << 'x' << input.frame_size.height << endl;
+    return false;
+  }
+
+  // the output is named after the input directory or the stream file
+  input.base = output_base(input.path, input.is_dir);
+
+  return true;
+}
+
+
+/** Name of the video of the tracking, empty for no video */
+static string video_output(const Input &input, const RunOptions &run)
+{
+  if( !run.write_video )
+    return string();
+
+  string video_name = input.base + "_tracking.avi";
+  cerr << "Warning: Writing the tracked video to " << video_name << endl;
+
+  return video_name;
+}
+
+
+/** Totals for an input tracked in batch mode */
+struct BatchSummary
+{
+  int images;
+  int warnings;       // images where too few regions were found to track all the spots
+  double seconds;
+  int full_scans;
+  int coarse_scans;
+  const char *kernel_name;
+};
+
+
+/**
+ * Batch mode - track an input on thread_count threads and write the output. memory_bytes is
+ * for the tracked images held for the video, image_done(images) is called as each image is
+ * handed to the writer.
+ */
+static BatchSummary track_batch(const Input &input, const TrackOptions &options, const RunOptions &run, MatFileDump &outfile,
+                                int thread_count, size_t memory_bytes, bool print_warnings, const function<void(int)> &image_done)
+{
+  // no display to wait on or keys to poll, just track everything as fast as possible
+  int64 start_ticks = getTickCount();
+
+  string video_name = video_output(input, run);
+  double video_fps = options.fields ? video_frame_rate * 2 : video_frame_rate;
+
+  // the tracking is drawn on full frame BGR images, some of which are waiting to be written
+  size_t image_bytes = (size_t)input.frame_size.area() * 3;
+  int images_kept = (int)min( memory_bytes / image_bytes, (size_t)INT_MAX ) - write_queue_depth;
+
+  BatchTracker batch(input.path, options, input.start_file, input.end_file, run.write_video);
+  batch.start(thread_count, images_kept);
+
+  BatchSummary summary = { 0, 0, 0, 0, 0, "" };
+  vector<Point2d> track_points;
+
+  {
+    ResultWriter writer(outfile, video_name, video_fps, print_warnings);
+    Mat image;
+
+    for( int file_num = input.start_file; file_num < input.end_file; ++file_num )
+    {
+      int distinct_region_count;
+      batch.take(file_num, distinct_region_count, track_points, image);
+
+      if( distinct_region_count < (int)track_points.size() )
+        ++summary.warnings;
+
+      writer.write(file_num, distinct_region_count, track_points, image);
+      image_done(++summary.images);
+    }
+  }   // the writer finishes everything queued
+
+  batch.join();
+
+  summary.seconds = (getTickCount() - start_ticks) / getTickFrequency();
+  summary.full_scans = batch.full_scans;
+  summary.coarse_scans = batch.coarse_scans;
+  summary.kernel_name = batch.kernel_name;
+
+  return summary;
+}
+
+
+/**
+ * Batch mode for several inputs, e.g. all the directories of a recording session. Up to
+ * thread_count inputs are tracked at once, each on its share of the threads, and the next one
+ * is started as soon as one finishes. As when tracking one, an input whose output exists
+ * already is skipped. The memory limit for the images held for the video is shared between
+ * the inputs being tracked, so it holds however many there are. Every input is checked before
+ * any are tracked so a bad one doesn't turn up hours in. The progress over all of them is
+ * printed every batch_progress_interval seconds, and a summary of each at the end.
+ */
+static int track_batch_inputs(const vector<string> &paths, const TrackOptions &options, const RunOptions &run,
+                              int thread_count, StatsReport &stats)
+{
+  vector<Input> inputs( paths.size() );
+
+  for( size_t index=0; index < paths.size(); ++index )
+  {
+    if( !open_input(paths[index], options, run, inputs[index]) )
+      return -1;
+
+    // the outputs all go in the current directory, named after the inputs
+    for( size_t other=0; other < index; ++other )
+    {
+      if( inputs[other].base == inputs[index].base )
+      {
+        cerr << "Error: " << inputs[other].path << " and " << inputs[index].path << " would both be tracked to "
+             << inputs[index].base << "_tracking.mat" << endl;
+        return -1;
+      }
+    }
+  }
+
+  int workers = min( thread_count, (int)inputs.size() );
+  int threads_each = max( thread_count / workers, 1 );
+  size_t memory_each = ((size_t)run.batch_memory << 20) / workers;
+
+  atomic<int> next_input(0);
+  atomic<int> images_done(0);
+  atomic<int> images_total(0);
+
+  for( size_t index=0; index < inputs.size(); ++index )
+    images_total += inputs[index].end_file - inputs[index].start_file;
+
+  // each input's summary is only written by the worker tracking it
+  vector<BatchSummary> summaries( inputs.size() );
+  vector<bool> skipped( inputs.size(), false );
+
+  mutex finished_mutex;
+  condition_variable input_finished;
+  int inputs_finished = 0;
+
+  int64 start_ticks = getTickCount();
+  stats.restart();
+
+  vector<thread> pool;
+  for( int worker=0; worker < workers; ++worker )
+  {
+    pool.push_back( thread( [&]
+    {
+      for( int index; (index = next_input++) < (int)inputs.size(); )
+      {
+        const Input &input = inputs[index];
+        int image_count = input.end_file - input.start_file;
+
+        MatFileDump outfile;
+        if( run.write_mat && !open_outfile(outfile, input.base, image_count) )
+        {
+          lock_guard<mutex> lock(finished_mutex);
+          skipped[index] = true;
+          images_total -= image_count;
+        }
+        else
+        {
+          // the warnings from every input at once would be unreadable, they are counted instead
+          summaries[index] = track_batch(input, options, run, outfile, threads_each, memory_each, false,
+                                         [&](int) { ++images_done; });
+        }
+
+        lock_guard<mutex> lock(finished_mutex);
+        ++inputs_finished;
+        input_finished.notify_all();
+      }
+    } ) );
+  }
+
+  {
+    unique_lock<mutex> lock(finished_mutex);
+
+    while( !input_finished.wait_for( lock, chrono::seconds(batch_progress_interval),
+                                     [&]{ return inputs_finished == (int)inputs.size(); } ) )
+    {
+      double seconds = (getTickCount() - start_ticks) / getTickFrequency();
+      int done = images_done;
+      int total = images_total;
+
+      cerr << "Progress: " << done << '/' << total << " images (" << fixed << setprecision(1) << 100.0 * done / max(total, 1) << "%), "
+           << inputs_finished << '/' << inputs.size() << " inputs finished, " << done / max(seconds, 1e-9) << " frames/s" << endl;
+    }
+  }
+
+  for( size_t index=0; index < pool.size(); ++index )
+    pool[index].join();
+
+  double seconds = (getTickCount() - start_ticks) / getTickFrequency();
+
+  size_t name_width = 5;
+  for( size_t index=0; index < inputs.size(); ++index )
+    name_width = max( name_width, inputs[index].base.length() );
+
+  cerr << left << setw(name_width) << "input" << right << setw(10) << "images" << setw(10) << "warnings"
+       << setw(10) << "seconds" << setw(12) << "frames/s" << endl;
+
+  int images = 0;
+  int warnings = 0;
+  int skipped_count = 0;
+
+  for( size_t index=0; index < inputs.size(); ++index )
+  {
+    cerr << left << setw(name_width) << inputs[index].base << right;
+
+    if( skipped[index] )
+    {
+      cerr << "  skipped, " << inputs[index].base << "_tracking.mat exists already" << endl;
+      ++skipped_count;
+      continue;
+    }
+
+    const BatchSummary &summary = summaries[index];
+    cerr << setw(10) << summary.images << setw(10) << summary.warnings << setw(10) << fixed << setprecision(1) << summary.seconds
+         << setw(12) << summary.images / max(summary.seconds, 1e-9) << endl;
+
+    images += summary.images;
+    warnings += summary.warnings;
+  }
+
+  cerr << "Processed " << images << " images from " << inputs.size() - skipped_count << " inputs (" << skipped_count << " skipped) in "
+       << fixed << setprecision(2) << seconds << " s (" << images / max(seconds, 1e-9) << " frames/s, " << warnings << " warnings, "
+       << workers << " at once on " << threads_each << (threads_each == 1 ? " thread" : " threads") << " each)" << endl;
+
+  stats.finish(images);
+
+  return 0;
+}
+
+
+/** @function main */
+int main( int argc, char** argv )
+{
+  bool headless = false;       // batch mode - no HighGUI windows, overlay drawing or frame pacing
+  int thread_count = 0;        // batch mode threads, 0 until set - then one for an input, one per core for several
+  bool live = false;           // track a stream as it arrives, dropping images to keep up
+
+  StatsReport stats;
+
+  LensCorrection lens;
+  SpotColourTable colour_table;
+  TrackOptions options = { default_fields, default_track_regions, default_thresholds, false, false, 1, 1, false, NULL, NULL };
+  RunOptions run = { default_start_file, false, false, false, "", default_batch_memory, 0, 0 };
+  string make_table_name;      // write a colour table instead of tracking
+
+  int opt;
+  while( (opt = getopt(argc, argv, "bcC:fG:hij:k:lL:mM:n:p:r:s:S:t:T:uvw")) != -1 )
+  {
+    switch(opt)
+    {
+      case 'b':
+        headless = true;
+        break;
+
+      case 'c':
+        options.chroma_planes = true;
+        break;
+
+      case 'C':
+        if( !read_config(optarg, options, run) )
+          return -1;
+        break;
+
+      case 'f':
+        options.fields = false;
+        break;
+
+      case 'G':
+        make_table_name = optarg;
+        break;
+
+      case 'i':
+        options.split_frames = true;
+        break;
+
+      case 'j':
+        thread_count = atoi(optarg);
+        if( thread_count <= 0 )
+          thread_count = max( (int)thread::hardware_concurrency(), 1 );
+        break;
+
+      case 'k':
+        if( sscanf(optarg, "%d,%d,%d", &options.thresholds.max_green, &options.thresholds.blue_margin, &options.thresholds.green_margin) != 3 )
+        {
+          cerr << "Error: The -k thresholds must be given as max_green,blue_margin,green_margin" << endl;
+          return -1;
+        }
+        break;
+
+      case 'l':
+        live = true;
+        break;
+
+      case 'L':
+        run.colour_table = optarg;
+        break;
+
+      case 'm':
+        run.write_mat = true;
+        break;
+
+      case 'M':
+        run.batch_memory = atoi(optarg);
+        break;
+
+      case 'n':
+        options.regions = atoi(optarg);
+        break;
+
+      case 'p':
+        options.pyramid_factor = atoi(optarg);
+        break;
+
+      case 'r':
+        if( sscanf(optarg, "%dx%d", &run.raw_width, &run.raw_height) != 2 )
+        {
+          cerr << "Error: The -r frame size must be given as widthxheight" << endl;
+          return -1;
+        }
+        break;
+
+      case 's':
+        options.strips = atoi(optarg);
+        break;
+
+      case 'S':
+        run.start_file = atoi(optarg);
+        break;
+
+      case 't':
+        stats.interval = max( atoi(optarg), 0 );
+        break;
+
+      case 'T':
+        stats.csv_name = optarg;
+        break;
+
+      case 'u':
+        run.undistort = true;
+        break;
+
+      case 'v':
+        run.write_video = true;
+        break;
+
+      case 'w':
+        options.windowed = true;
+        break;
+
+      case 'h':
+        usage(argv[0]);
+        return 0;
+
+      default:
+        usage(argv[0]);
+        return -1;
+    }
+  }
+
+  // the options can come from the config file as well as the command line, check them once
+  // they are all in
+  if( options.regions < 4 )
+  {
+    cerr << "Error: At least the 4 spots of the leg have to be tracked" << endl;
+    return -1;
+  }
+
+  if( options.pyramid_factor != 1 && options.pyramid_factor != 2 && options.pyramid_factor != 4 )
+  {
+    cerr << "Error: The -p factor must be 2 or 4" << endl;
+    return -1;
+  }
+
+  if( options.strips <= 0 )
+    options.strips = max( getNumThreads(), 1 );
+
+  if( options.split_frames && !options.fields )
+  {
+    cerr << "Error: -i splits the frames into fields, it can't be used with -f" << endl;
+    return -1;
+  }
+
+  if( run.start_file < 0 )
+  {
+    cerr << "Error: The first image can't be negative" << endl;
+    return -1;
+  }
+
+  if( run.batch_memory <= 0 )
+  {
+    cerr << "Error: The -M memory for batch mode must be at least 1 MB" << endl;
+    return -1;
+  }
+
+  if( (run.raw_width > 0 || run.raw_height > 0) && !live )
+  {
+    cerr << "Error: A raw 4:2:0 stream (-r) can only be tracked live (-l)" << endl;
+    return -1;
+  }
+
+  if( !make_table_name.empty() )
+    return make_colour_table(make_table_name, options.thresholds, argc - optind, argv + optind);
+
+  if( run.undistort )
+  {
+    if( !lens.open("calib.xml") )
+      return -1;
+
+    options.lens = &lens;
+  }
+
+  if( !run.colour_table.empty() )
+  {
+    if( !colour_table.load(run.colour_table) )
+      return -1;
+
+    options.colour_table = &colour_table;
+  }
+
+  if( live )
+  {
+    string input = optind < argc ? argv[optind] : "-";
+
+    MatFileDump outfile;
+    if( run.write_mat && !open_outfile(outfile, input == "-" ? "live" : output_base(input, false), 0) )
+      return -1;
+
+    stats.restart();
+    return track_live(input, options, run, outfile, stats);
+  }
+
+  // the inputs, any can be a pattern matching several
+  vector<string> inputs;
+  if( optind == argc )
+    inputs.push_back("./");
+  else if( !expand_inputs(argv + optind, argc - optind, inputs) )
+    return -1;
+
+  if( thread_count == 0 )
+    thread_count = inputs.size() > 1 ? max( (int)thread::hardware_concurrency(), 1 ) : 1;
+
+  if( inputs.size() > 1 )
+  {
+    if( !headless )
+    {
+      cerr << "Error: Several inputs can only be tracked in batch mode (-b)" << endl;
+      return -1;
+    }
+
+    return track_batch_inputs(inputs, options, run, thread_count, stats);
+  }
+
+  Input input;
+  if( !open_input(inputs[0], options, run, input) )
+    return -1;
+
+  int start_file = input.start_file;
+  int end_file = input.end_file;
+
+  MatFileDump outfile;
+  if( run.write_mat && !open_outfile(outfile, input.base, end_file - start_file) )
+    return -1;
+
+  vector<Point2d> track_points;
+
+  if( headless )
+  {
+    stats.restart();
+
+    BatchSummary summary = track_batch(input, options, run, outfile, thread_count, (size_t)run.batch_memory << 20, true,
+                                       [&](int images) { stats.image_done(images); });
+
+    cerr << "Processed " << summary.images << " images in " << fixed << setprecision(2) << summary.seconds << " s ("
+         << summary.images / max(summary.seconds, 1e-9) << " frames/s, " << thread_count << " threads, " << summary.kernel_name << " classifier, "
+         << summary.coarse_scans << " coarse and " << summary.full_scans << " full frame scans)" << endl;
+
+    stats.finish(summary.images);
+
+    return 0;
+  }
+
+  string in_dir = input.path;
+  ImageLoader image_loader(in_dir, options.fields, options.split_frames);
+
+  string video_name = video_output(input, run);
+  double video_fps = options.fields ? video_frame_rate * 2 : video_frame_rate;
+
+  SpotTracker tracker(options.regions, options.thresholds, options.chroma_planes, options.colour_table);
+  options.apply(tracker);
+
+  Mat image = image_loader.load_image(start_file); // use parameters from the first image to initialise the masks
+  Mat display_mask(image.size(), image.type());    // mask to display
+
+  // loading and writing are done on their own threads, and the display is kept on this one
+  size_t frame_bytes = image.total() * image.elemSize();
+  FrameCache frame_cache(in_dir, options, start_file, end_file, max(frame_cache_bytes / frame_bytes, (size_t)3));
+  ResultWriter writer(outfile, video_name, video_fps);
+  Display display(in_dir, options.fields);
+
+  ResultStore results(start_file, end_file);
+  int tracked = 0;
+
+  stats.restart();
+
+  /** Do the tracking - loop over all the image files */
+  thread tracking( [&]
+  {
+    TrackFrame frame;
+    int shown_file = -1;   // image in frame and on the display
+
+    bool pause = false;
+    bool quit = false;
+
+    for( int file_num = start_file; file_num < end_file && !quit; )
+    {
+      // each image is only tracked once, nothing needs doing while paused
+      if( file_num != shown_file )
+      {
+        frame_cache.get(file_num, frame);
+        shown_file = file_num;
+
+        if( !results.has(file_num) )
+        {
+          // start the windows again where batch mode starts a chunk, so the output is the same
+          if( (file_num - start_file) % batch_chunk == 0 )
+            tracker.set_windowed(options.windowed);
+
+          int distinct_region_count = track_image(tracker, file_num, image_loader.field_parity(file_num), frame, display_mask, track_points);
+          results.add(file_num, distinct_region_count, track_points);
+
+          stats.image_done(++tracked);
+        }
+        else
+        {
+          // gone back to an image that's been tracked, the mask isn't kept
+          display_mask.setTo(Scalar::all(255));
+        }
+
+        // the tracking is drawn at full frame size for the video here, for the display when
+        // it is shown
+        Mat image;
+        if( run.write_video )
+        {
+          StageTimer timer(STAGE_DRAW);
+          image = overlay_image(frame.bgr, options.fields);
+          draw_tracking(image, results.track_points(file_num));
+        }
+
+        // write out whatever is now tracked in order, the output is undistorted and the drawing
+        // is on the raw image
+        for( int write_num; (write_num = results.next_to_write()) >= 0; )
+        {
+          track_points = results.track_points(write_num);
+          if( options.lens != NULL )
+            options.lens->undistort(track_points);
+
+          writer.write(write_num, results.distinct_region_count(write_num), track_points,
+                       write_num == file_num ? image : Mat());
+        }
+
+        display.show(frame.bgr, results.track_points(file_num), display_mask);
+      }
+
+      // keys from the display, nothing happens until there is one while paused
+      char key = pause ? display.wait_key() : display.poll_key();
+
+      // do some simple video player actions with the result
+      switch(key)
+      {
+        // quit
+        case 27:   // ESC
+        case 'q':
+          cerr << "User quit, processed " << file_num << '/' << end_file << " images" << endl;
+          quit = true;
+          break;
+
+        // toggle pause
+        case ' ':
+          pause ^= true;
+          break;
+
+        // advance frame (when paused)
+        case 'n':
+        case '.':
+        case '>':
+          if( file_num+1 < end_file )
+            ++file_num;
+          break;
+
+        // back frame (when paused)
+        case 'N':
+        case ',':
+        case '<':
+          if( pause && file_num > start_file )
+            --file_num;
+          break;
+
+        default:
+          if( !pause )
+            ++file_num;
+          break;
+      }
+    }
+
+    display.finish();
+  } );
+
+  display.run();
+  tracking.join();
+
+  stats.finish(tracked);
 
   return 0;
 }
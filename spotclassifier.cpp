@@ -0,0 +1,439 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Graeme Hattan                                   *
+ *   graemeh.dev@googlemail.com                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SPOT_CLASSIFIER_X86
+#include <immintrin.h>
+#endif
+
+#include "spotclassifier.h"
+
+typedef SpotClassifier::MaskWord MaskWord;
+
+
+namespace
+{
+  /** Scalar classification of the pixels from start to cols, the mask must already be cleared */
+  void classify_pixels(const unsigned char *bgr, int start, int cols, MaskWord *mask, const SpotThresholds &thresholds)
+  {
+    for( int col=start; col < cols; ++col )
+    {
+      if( is_spot_colour(bgr + 3*col, thresholds) )
+        mask[col >> 6] |= (MaskWord)1 << (col & 63);
+    }
+  }
+
+  void classify_scalar(const unsigned char *bgr, int cols, MaskWord *mask, const SpotThresholds &thresholds)
+  {
+    memset(mask, 0, SpotClassifier::mask_words(cols) * sizeof(MaskWord));
+    classify_pixels(bgr, 0, cols, mask, thresholds);
+  }
+
+
+  /** Scalar table lookup of the pixels from start to cols, the mask must already be cleared */
+  void classify_table_pixels(const unsigned char *bgr, int start, int cols, MaskWord *mask, const SpotColourTable &table)
+  {
+    for( int col=start; col < cols; ++col )
+    {
+      if( table.contains(bgr + 3*col) )
+        mask[col >> 6] |= (MaskWord)1 << (col & 63);
+    }
+  }
+
+  void classify_table(const unsigned char *bgr, int cols, MaskWord *mask, const SpotColourTable &table)
+  {
+    memset(mask, 0, SpotClassifier::mask_words(cols) * sizeof(MaskWord));
+    classify_table_pixels(bgr, 0, cols, mask, table);
+  }
+
+
+#ifdef SPOT_CLASSIFIER_X86
+
+  /*
+   * The SIMD kernels do the three comparisons of is_spot_colour() with unsigned saturating
+   * subtraction so that nothing needs widening past 8 bits -
+   *
+   *   green < max_green             <=>  subs(green, max_green-1) == 0
+   *   red > blue - blue_margin      <=>  subs(subs(blue, red), blue_margin-1) == 0
+   *   red > green + green_margin    <=>  subs(subs(red, green), green_margin) != 0
+   *
+   * which holds for 1 <= max_green, blue_margin <= 256 and 0 <= green_margin <= 255. Other
+   * thresholds use the scalar kernel.
+   */
+
+  // pshufb masks to gather the blue, green and red bytes of 16 BGR pixels from three 16 byte
+  // loads, -1 zeroes the byte so the three shuffles can be or'ed together
+  #define SHUFFLE_MASKS \
+    const __m128i blue_0  = _mm_setr_epi8( 0, 3, 6, 9,12,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1); \
+    const __m128i blue_1  = _mm_setr_epi8(-1,-1,-1,-1,-1,-1, 2, 5, 8,11,14,-1,-1,-1,-1,-1); \
+    const __m128i blue_2  = _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 1, 4, 7,10,13); \
+    const __m128i green_0 = _mm_setr_epi8( 1, 4, 7,10,13,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1); \
+    const __m128i green_1 = _mm_setr_epi8(-1,-1,-1,-1,-1, 0, 3, 6, 9,12,15,-1,-1,-1,-1,-1); \
+    const __m128i green_2 = _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 2, 5, 8,11,14); \
+    const __m128i red_0   = _mm_setr_epi8( 2, 5, 8,11,14,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1); \
+    const __m128i red_1   = _mm_setr_epi8(-1,-1,-1,-1,-1, 1, 4, 7,10,13,-1,-1,-1,-1,-1,-1); \
+    const __m128i red_2   = _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 0, 3, 6, 9,12,15);
+
+
+  __attribute__((target("ssse3")))
+  void classify_ssse3(const unsigned char *bgr, int cols, MaskWord *mask, const SpotThresholds &thresholds)
+  {
+    memset(mask, 0, SpotClassifier::mask_words(cols) * sizeof(MaskWord));
+
+    SHUFFLE_MASKS
+
+    const __m128i green_limit  = _mm_set1_epi8( (char)(thresholds.max_green - 1) );
+    const __m128i blue_limit   = _mm_set1_epi8( (char)(thresholds.blue_margin - 1) );
+    const __m128i green_margin = _mm_set1_epi8( (char)thresholds.green_margin );
+    const __m128i zero         = _mm_setzero_si128();
+
+    int col = 0;
+
+    for( const unsigned char *pixels = bgr; col + 16 <= cols; col += 16, pixels += 48 )
+    {
+      __m128i in_0 = _mm_loadu_si128( (const __m128i *)pixels );
+      __m128i in_1 = _mm_loadu_si128( (const __m128i *)(pixels + 16) );
+      __m128i in_2 = _mm_loadu_si128( (const __m128i *)(pixels + 32) );
+
+      __m128i blue  = _mm_or_si128( _mm_or_si128( _mm_shuffle_epi8(in_0, blue_0),  _mm_shuffle_epi8(in_1, blue_1) ),  _mm_shuffle_epi8(in_2, blue_2) );
+      __m128i green = _mm_or_si128( _mm_or_si128( _mm_shuffle_epi8(in_0, green_0), _mm_shuffle_epi8(in_1, green_1) ), _mm_shuffle_epi8(in_2, green_2) );
+      __m128i red   = _mm_or_si128( _mm_or_si128( _mm_shuffle_epi8(in_0, red_0),   _mm_shuffle_epi8(in_1, red_1) ),   _mm_shuffle_epi8(in_2, red_2) );
+
+      // must be zero for the first two tests to pass
+      __m128i must_be_zero = _mm_or_si128( _mm_subs_epu8(green, green_limit),
+                                           _mm_subs_epu8(_mm_subs_epu8(blue, red), blue_limit) );
+
+      // must be non-zero for the third
+      __m128i must_be_set = _mm_subs_epu8( _mm_subs_epu8(red, green), green_margin );
+
+      __m128i spot = _mm_andnot_si128( _mm_cmpeq_epi8(must_be_set, zero), _mm_cmpeq_epi8(must_be_zero, zero) );
+
+      mask[col >> 6] |= (MaskWord)(unsigned)_mm_movemask_epi8(spot) << (col & 63);
+    }
+
+    classify_pixels(bgr, col, cols, mask, thresholds);
+  }
+
+
+  __attribute__((target("avx2")))
+  void classify_avx2(const unsigned char *bgr, int cols, MaskWord *mask, const SpotThresholds &thresholds)
+  {
+    memset(mask, 0, SpotClassifier::mask_words(cols) * sizeof(MaskWord));
+
+    SHUFFLE_MASKS
+
+    // pshufb works within each 128 bit lane, so the low lane holds pixels 0-15 and the high
+    // lane pixels 16-31 and the same shuffles are used in both
+    const __m256i blue_0_x2  = _mm256_broadcastsi128_si256(blue_0);
+    const __m256i blue_1_x2  = _mm256_broadcastsi128_si256(blue_1);
+    const __m256i blue_2_x2  = _mm256_broadcastsi128_si256(blue_2);
+    const __m256i green_0_x2 = _mm256_broadcastsi128_si256(green_0);
+    const __m256i green_1_x2 = _mm256_broadcastsi128_si256(green_1);
+    const __m256i green_2_x2 = _mm256_broadcastsi128_si256(green_2);
+    const __m256i red_0_x2   = _mm256_broadcastsi128_si256(red_0);
+    const __m256i red_1_x2   = _mm256_broadcastsi128_si256(red_1);
+    const __m256i red_2_x2   = _mm256_broadcastsi128_si256(red_2);
+
+    const __m256i green_limit  = _mm256_set1_epi8( (char)(thresholds.max_green - 1) );
+    const __m256i blue_limit   = _mm256_set1_epi8( (char)(thresholds.blue_margin - 1) );
+    const __m256i green_margin = _mm256_set1_epi8( (char)thresholds.green_margin );
+    const __m256i zero         = _mm256_setzero_si256();
+
+    int col = 0;
+
+    for( const unsigned char *pixels = bgr; col + 32 <= cols; col += 32, pixels += 96 )
+    {
+      __m256i in_0 = _mm256_inserti128_si256( _mm256_castsi128_si256( _mm_loadu_si128((const __m128i *)pixels) ),
+                                              _mm_loadu_si128((const __m128i *)(pixels + 48)), 1 );
+      __m256i in_1 = _mm256_inserti128_si256( _mm256_castsi128_si256( _mm_loadu_si128((const __m128i *)(pixels + 16)) ),
+                                              _mm_loadu_si128((const __m128i *)(pixels + 64)), 1 );
+      __m256i in_2 = _mm256_inserti128_si256( _mm256_castsi128_si256( _mm_loadu_si128((const __m128i *)(pixels + 32)) ),
+                                              _mm_loadu_si128((const __m128i *)(pixels + 80)), 1 );
+
+      __m256i blue  = _mm256_or_si256( _mm256_or_si256( _mm256_shuffle_epi8(in_0, blue_0_x2),  _mm256_shuffle_epi8(in_1, blue_1_x2) ),
+                                       _mm256_shuffle_epi8(in_2, blue_2_x2) );
+      __m256i green = _mm256_or_si256( _mm256_or_si256( _mm256_shuffle_epi8(in_0, green_0_x2), _mm256_shuffle_epi8(in_1, green_1_x2) ),
+                                       _mm256_shuffle_epi8(in_2, green_2_x2) );
+      __m256i red   = _mm256_or_si256( _mm256_or_si256( _mm256_shuffle_epi8(in_0, red_0_x2),   _mm256_shuffle_epi8(in_1, red_1_x2) ),
+                                       _mm256_shuffle_epi8(in_2, red_2_x2) );
+
+      __m256i must_be_zero = _mm256_or_si256( _mm256_subs_epu8(green, green_limit),
+                                              _mm256_subs_epu8(_mm256_subs_epu8(blue, red), blue_limit) );
+
+      __m256i must_be_set = _mm256_subs_epu8( _mm256_subs_epu8(red, green), green_margin );
+
+      __m256i spot = _mm256_andnot_si256( _mm256_cmpeq_epi8(must_be_set, zero), _mm256_cmpeq_epi8(must_be_zero, zero) );
+
+      mask[col >> 6] |= (MaskWord)(unsigned)_mm256_movemask_epi8(spot) << (col & 63);
+    }
+
+    classify_pixels(bgr, col, cols, mask, thresholds);
+  }
+
+
+  /**
+   * Look up 8 pixels in the table - the low 8 bytes of blue, green and red are the channels
+   * already quantised to 5 bits. Returns a bit per pixel.
+   */
+  __attribute__((target("avx2")))
+  inline unsigned table_lookup_avx2(__m128i blue, __m128i green, __m128i red, const int *words)
+  {
+    const __m256i low_5 = _mm256_set1_epi32(31);
+
+    __m256i index = _mm256_or_si256( _mm256_or_si256( _mm256_slli_epi32(_mm256_cvtepu8_epi32(blue), 10),
+                                                      _mm256_slli_epi32(_mm256_cvtepu8_epi32(green), 5) ),
+                                     _mm256_cvtepu8_epi32(red) );
+
+    __m256i word = _mm256_i32gather_epi32( words, _mm256_srli_epi32(index, 5), 4 );
+
+    // move each cell's bit up to the sign bit, where movemask picks it up
+    __m256i bit = _mm256_sllv_epi32( word, _mm256_sub_epi32(low_5, _mm256_and_si256(index, low_5)) );
+
+    return (unsigned)_mm256_movemask_ps( _mm256_castsi256_ps(bit) );
+  }
+
+
+  __attribute__((target("avx2")))
+  void classify_table_avx2(const unsigned char *bgr, int cols, MaskWord *mask, const SpotColourTable &table)
+  {
+    memset(mask, 0, SpotClassifier::mask_words(cols) * sizeof(MaskWord));
+
+    SHUFFLE_MASKS
+
+    const int *words = (const int *)table.data();
+    const __m128i low_5 = _mm_set1_epi8(31);
+
+    int col = 0;
+
+    for( const unsigned char *pixels = bgr; col + 16 <= cols; col += 16, pixels += 48 )
+    {
+      __m128i in_0 = _mm_loadu_si128( (const __m128i *)pixels );
+      __m128i in_1 = _mm_loadu_si128( (const __m128i *)(pixels + 16) );
+      __m128i in_2 = _mm_loadu_si128( (const __m128i *)(pixels + 32) );
+
+      __m128i blue  = _mm_or_si128( _mm_or_si128( _mm_shuffle_epi8(in_0, blue_0),  _mm_shuffle_epi8(in_1, blue_1) ),  _mm_shuffle_epi8(in_2, blue_2) );
+      __m128i green = _mm_or_si128( _mm_or_si128( _mm_shuffle_epi8(in_0, green_0), _mm_shuffle_epi8(in_1, green_1) ), _mm_shuffle_epi8(in_2, green_2) );
+      __m128i red   = _mm_or_si128( _mm_or_si128( _mm_shuffle_epi8(in_0, red_0),   _mm_shuffle_epi8(in_1, red_1) ),   _mm_shuffle_epi8(in_2, red_2) );
+
+      // quantise, there's no 8 bit shift so the bits shifted in from the next byte are masked off
+      blue  = _mm_and_si128( _mm_srli_epi16(blue, 3),  low_5 );
+      green = _mm_and_si128( _mm_srli_epi16(green, 3), low_5 );
+      red   = _mm_and_si128( _mm_srli_epi16(red, 3),   low_5 );
+
+      unsigned spots = table_lookup_avx2(blue, green, red, words)
+                     | table_lookup_avx2(_mm_srli_si128(blue, 8), _mm_srli_si128(green, 8), _mm_srli_si128(red, 8), words) << 8;
+
+      mask[col >> 6] |= (MaskWord)spots << (col & 63);
+    }
+
+    classify_table_pixels(bgr, col, cols, mask, table);
+  }
+
+  #undef SHUFFLE_MASKS
+
+#endif // SPOT_CLASSIFIER_X86
+}
+
+
+
+const char SpotColourTable::magic[8] = { 'R', 'B', 'S', 'P', 'O', 'T', 'C', '1' };
+
+
+SpotColourTable::SpotColourTable()
+{
+  memset(words, 0, sizeof(words));
+}
+
+
+SpotColourTable::SpotColourTable(const SpotThresholds &thresholds)
+{
+  memset(words, 0, sizeof(words));
+
+  int size = 1 << (8 - channel_bits);   // colours across a cell in each channel
+  unsigned char pixel[3];
+
+  for( int index=0; index < cells; ++index )
+  {
+    int blue  = (index >> 10) * size;
+    int green = ((index >> 5) & 31) * size;
+    int red   = (index & 31) * size;
+
+    int passed = 0;
+
+    for( int b = blue; b < blue + size; ++b )
+      for( int g = green; g < green + size; ++g )
+        for( int r = red; r < red + size; ++r )
+        {
+          pixel[0] = b;
+          pixel[1] = g;
+          pixel[2] = r;
+          passed += is_spot_colour(pixel, thresholds) ? 1 : 0;
+        }
+
+    set( index, 2*passed > size*size*size );
+  }
+}
+
+
+void SpotColourTable::set(int cell, bool spot)
+{
+  if( spot )
+    words[cell >> 5] |= 1u << (cell & 31);
+  else
+    words[cell >> 5] &= ~(1u << (cell & 31));
+}
+
+
+bool SpotColourTable::load(const std::string &file_name)
+{
+  std::ifstream file(file_name.c_str(), std::ios::binary);
+
+  char header[sizeof(magic)];
+  if( !file.read(header, sizeof(header)) || memcmp(header, magic, sizeof(magic)) != 0 )
+  {
+    std::cerr << "Error: " << file_name << " isn't a spot colour table" << std::endl;
+    return false;
+  }
+
+  if( !file.read((char *)words, sizeof(words)) )
+  {
+    std::cerr << "Error: " << file_name << " is too short for a spot colour table" << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+
+bool SpotColourTable::save(const std::string &file_name) const
+{
+  std::ofstream file(file_name.c_str(), std::ios::binary | std::ios::trunc);
+
+  if( !file.write(magic, sizeof(magic)) || !file.write((const char *)words, sizeof(words)) || !file.flush() )
+  {
+    std::cerr << "Error: Failed writing " << file_name << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+
+
+SpotColourTable SpotColourTrainer::train(const SpotColourTable &start) const
+{
+  SpotColourTable table = start;
+
+  for( int index=0; index < SpotColourTable::cells; ++index )
+  {
+    if( spot_counts[index] + background_counts[index] > 0 )
+      table.set( index, spot_counts[index] > background_counts[index] );
+  }
+
+  return table;
+}
+
+
+int SpotColourTrainer::cells_sampled() const
+{
+  int sampled = 0;
+  for( int index=0; index < SpotColourTable::cells; ++index )
+    sampled += spot_counts[index] + background_counts[index] > 0 ? 1 : 0;
+
+  return sampled;
+}
+
+
+int SpotColourTrainer::cells_changed(const SpotColourTable &start) const
+{
+  SpotColourTable trained = train(start);
+
+  int changed = 0;
+  for( int index=0; index < SpotColourTable::cells; ++index )
+  {
+    bool before = (start.data()[index >> 5] >> (index & 31)) & 1;
+    bool after = (trained.data()[index >> 5] >> (index & 31)) & 1;
+    changed += before != after ? 1 : 0;
+  }
+
+  return changed;
+}
+
+
+
+SpotClassifier::SpotClassifier(const SpotThresholds &thresholds, Kernel requested) :
+  thresholds(thresholds),
+  kernel_type_(KERNEL_SCALAR),
+  kernel(classify_scalar),
+  table_kernel(NULL)
+{
+#ifdef SPOT_CLASSIFIER_X86
+  // the SIMD kernels only handle thresholds which fit the 8 bit saturating arithmetic
+  bool simd_thresholds = thresholds.max_green    >= 1 && thresholds.max_green    <= 256
+                      && thresholds.blue_margin  >= 1 && thresholds.blue_margin  <= 256
+                      && thresholds.green_margin >= 0 && thresholds.green_margin <= 255;
+
+  if( !simd_thresholds )
+    return;
+
+  __builtin_cpu_init();
+
+  if( (requested == KERNEL_BEST || requested == KERNEL_AVX2) && __builtin_cpu_supports("avx2") )
+  {
+    kernel_type_ = KERNEL_AVX2;
+    kernel = classify_avx2;
+  }
+  else if( (requested == KERNEL_BEST || requested == KERNEL_SSSE3) && __builtin_cpu_supports("ssse3") )
+  {
+    kernel_type_ = KERNEL_SSSE3;
+    kernel = classify_ssse3;
+  }
+#else
+  (void)requested;
+#endif
+}
+
+
+SpotClassifier::SpotClassifier(const SpotColourTable &table, Kernel requested) :
+  thresholds(),
+  table(table),
+  kernel_type_(KERNEL_TABLE),
+  kernel(classify_scalar),
+  table_kernel(classify_table)
+{
+#ifdef SPOT_CLASSIFIER_X86
+  __builtin_cpu_init();
+
+  if( (requested == KERNEL_BEST || requested == KERNEL_TABLE_AVX2) && __builtin_cpu_supports("avx2") )
+  {
+    kernel_type_ = KERNEL_TABLE_AVX2;
+    table_kernel = classify_table_avx2;
+  }
+#else
+  (void)requested;
+#endif
+}
+
+
+const char *SpotClassifier::kernel_name() const
+{
+  switch(kernel_type_)
+  {
+    case KERNEL_AVX2:       return "avx2";
+    case KERNEL_SSSE3:      return "ssse3";
+    case KERNEL_TABLE:      return "table";
+    case KERNEL_TABLE_AVX2: return "table avx2";
+    default:                return "scalar";
+  }
+}
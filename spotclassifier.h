@@ -0,0 +1,160 @@
+#ifndef SPOTCLASSIFIER_H
+#define SPOTCLASSIFIER_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/** Thresholds for the tracking spot colour test, see is_spot_colour() */
+struct SpotThresholds
+{
+  int max_green;     // green must be below this
+  int blue_margin;   // red must be more than blue minus this
+  int green_margin;  // red must be more than green plus this
+};
+
+
+/** The tracking spot colour test for a single BGR pixel */
+inline bool is_spot_colour(const unsigned char *pixel, const SpotThresholds &thresholds)
+{
+  // pixel[0] is blue, pixel[1] is green and pixel[2] is red
+  return pixel[1] < thresholds.max_green
+      && pixel[2] > (int)pixel[0] - thresholds.blue_margin
+      && pixel[2] > (int)pixel[1] + thresholds.green_margin;
+}
+
+
+/**
+ * The tracking spot colour test as a lookup table - a bit for each cell of a 32x32x32 cube over
+ * BGR, with each channel quantised to its top 5 bits. The whole table is 4 KB so it stays in the
+ * L1 cache. It can be generated from the thresholds or trained from marked sample pixels (see
+ * SpotColourTrainer) and saved, so the spot colour can be retuned without touching the code.
+ */
+class SpotColourTable
+{
+  public:
+    static const int channel_bits = 5;
+    static const int cells = 1 << (3*channel_bits);
+
+    /** A table with no spot colours */
+    SpotColourTable();
+
+    /** A table generated from the thresholds, a cell is set if most of its colours pass */
+    explicit SpotColourTable(const SpotThresholds &thresholds);
+
+    /** The cell a BGR pixel falls in */
+    static int cell(const unsigned char *pixel)
+    {
+      return (pixel[0] >> 3) << 10 | (pixel[1] >> 3) << 5 | pixel[2] >> 3;
+    }
+
+    bool contains(const unsigned char *pixel) const
+    {
+      int index = cell(pixel);
+      return (words[index >> 5] >> (index & 31)) & 1;
+    }
+
+    void set(int cell, bool spot);
+
+    /** Bit (cell % 32) of word (cell / 32) is set for the spot colours */
+    const uint32_t *data() const { return words; }
+
+    /** Load a table saved by save(), false (with the error printed) if it can't be */
+    bool load(const std::string &file_name);
+    bool save(const std::string &file_name) const;
+
+  private:
+    uint32_t words[cells / 32];
+
+    static const char magic[8];
+};
+
+
+/**
+ * Trains a colour table from sample pixels marked as spot or background. A cell is set if more
+ * of its samples were spots than background, cells without any samples keep their value from
+ * the table the training starts from (e.g. one generated from the thresholds).
+ */
+class SpotColourTrainer
+{
+  public:
+    SpotColourTrainer() : spot_counts(SpotColourTable::cells, 0), background_counts(SpotColourTable::cells, 0) {}
+
+    void add(const unsigned char *pixel, bool spot)
+    {
+      ++(spot ? spot_counts : background_counts)[ SpotColourTable::cell(pixel) ];
+    }
+
+    SpotColourTable train(const SpotColourTable &start) const;
+
+    /** Cells with samples, and the cells the training changed from the start table */
+    int cells_sampled() const;
+    int cells_changed(const SpotColourTable &start) const;
+
+  private:
+    std::vector<uint32_t> spot_counts;
+    std::vector<uint32_t> background_counts;
+};
+
+
+/**
+ * Classifies rows of BGR pixels into a packed bitmask, one bit per pixel. Bit (col % 64) of
+ * word (col / 64) is set if the pixel at col is a tracking spot colour. SIMD kernels test 16
+ * (SSSE3) or 32 (AVX2) pixels at a time, the best one the CPU supports is picked at run time
+ * with a scalar fallback. With a colour table the test is a lookup in the table instead, 8
+ * pixels at a time with AVX2 gathers.
+ */
+class SpotClassifier
+{
+  public:
+    typedef uint64_t MaskWord;
+
+    enum Kernel
+    {
+      KERNEL_BEST,
+      KERNEL_SCALAR,
+      KERNEL_SSSE3,
+      KERNEL_AVX2,
+      KERNEL_TABLE,
+      KERNEL_TABLE_AVX2
+    };
+
+    SpotClassifier(const SpotThresholds &thresholds, Kernel requested=KERNEL_BEST);
+
+    /** Classify with a colour table instead of the thresholds */
+    SpotClassifier(const SpotColourTable &table, Kernel requested=KERNEL_BEST);
+
+    /** Classify a row of cols BGR pixels, bits past the end of the row are cleared */
+    void classify_row(const unsigned char *bgr, int cols, MaskWord *mask) const
+    {
+      if( table_kernel != NULL )
+        table_kernel(bgr, cols, mask, table);
+      else
+        kernel(bgr, cols, mask, thresholds);
+    }
+
+    /** The spot colour test for a single BGR pixel, the same one the rows are classified with */
+    bool is_spot(const unsigned char *pixel) const
+    {
+      return table_kernel != NULL ? table.contains(pixel) : is_spot_colour(pixel, thresholds);
+    }
+
+    static int mask_words(int cols) { return (cols + 63) / 64; }
+
+    Kernel kernel_type() const { return kernel_type_; }
+    const char *kernel_name() const;
+
+  private:
+    typedef void (*KernelFunction)(const unsigned char *, int, MaskWord *, const SpotThresholds &);
+    typedef void (*TableKernelFunction)(const unsigned char *, int, MaskWord *, const SpotColourTable &);
+
+    SpotThresholds thresholds;
+    SpotColourTable table;
+
+    Kernel kernel_type_;
+    KernelFunction kernel;
+    TableKernelFunction table_kernel;   // NULL when classifying with the thresholds
+};
+
+#endif // SPOTCLASSIFIER_H
@@ -0,0 +1,707 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Graeme Hattan                                   *
+ *   graemeh.dev@googlemail.com                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <cstring>
+#include <cmath>
+#include <functional>
+
+#include "spottracker.h"
+#include "stagestats.h"
+#include "y4mreader.h"
+
+using namespace std;
+using namespace cv;
+
+
+// extra space around a spot's last size when placing its window, on top of the distance moved
+static const int window_margin = 8;
+
+// smallest spot (in full resolution pixels) the coarse search looks at - anything smaller
+// is taken to be noise
+static const int min_spot_area = 16;
+
+
+// fewest rows worth labelling on a thread of their own
+static const int min_strip_rows = 16;
+
+
+// number of samples taken across size pixels every step pixels, starting half a step in
+static inline int coarse_samples(int size, int step)
+{
+  return (size - step/2 + step - 1) / step;
+}
+
+
+namespace
+{
+  /** Labels a range of strips of an image, for cv::parallel_for_ */
+  class StripLabeler : public ParallelLoopBody
+  {
+    public:
+      StripLabeler(const function<void(int)> &label_strip) : label_strip(label_strip) {}
+
+      void operator()(const Range &strips) const
+      {
+        for( int strip = strips.start; strip < strips.end; ++strip )
+          label_strip(strip);
+      }
+
+    private:
+      function<void(int)> label_strip;
+  };
+}
+
+
+
+ChromaSpotTable::ChromaSpotTable(const SpotClassifier &classifier)
+{
+  uchar bgr[3];
+
+  for( int cb=0; cb<256; ++cb )
+  {
+    for( int cr=0; cr<256; ++cr )
+    {
+      table[cb][cr] = false;
+
+      for( int y=0; y<256 && !table[cb][cr]; ++y )
+      {
+        ycbcr_to_bgr_pixel(y, cb, cr, bgr);
+        table[cb][cr] = classifier.is_spot(bgr);
+      }
+    }
+  }
+}
+
+
+
+SpotTracker::SpotTracker(int num_spots, const SpotThresholds &thresholds, bool chroma_planes, const SpotColourTable *colour_table) :
+  SpotTracker(num_spots, colour_table != NULL ? SpotClassifier(*colour_table) : SpotClassifier(thresholds), chroma_planes)
+{
+}
+
+
+SpotTracker::SpotTracker(int num_spots, const SpotClassifier &classifier, bool chroma_planes) :
+  num_spots(num_spots),
+  classifier_(classifier),
+  chroma_table(chroma_planes ? new ChromaSpotTable(classifier_) : NULL),
+  strip_labelers(1),
+  strip_masks(1),
+  largest(num_spots),
+  windowed(false),
+  locked(false),
+  last_frame(-2),
+  tracks(num_spots),
+  pyramid_factor(1),
+  full_scan_count(0),
+  coarse_scan_count(0)
+{
+}
+
+
+SpotTracker::~SpotTracker()
+{
+  delete chroma_table;
+}
+
+
+int SpotTracker::track(int frame_num, const TrackFrame &frame, Mat &display_mask, vector<Point2d> &track_points)
+{
+  // the windows are only any use if this frame carries straight on from the last one
+  bool follows_on = frame_num == last_frame+1;
+  bool use_windows = windowed && locked && follows_on;
+  last_frame = frame_num;
+
+  int distinct_region_count = use_windows ? track_windows(frame, display_mask) : -1;
+
+  if( distinct_region_count < 0 && pyramid_factor > 1 )
+  {
+    ++coarse_scan_count;
+    distinct_region_count = acquire_coarse(frame, display_mask);
+  }
+
+  if( distinct_region_count < 0 )
+  {
+    ++full_scan_count;
+
+    regions.clear();
+    label(frame, Rect(Point(0, 0), frame.size()), display_mask, regions);
+
+    distinct_region_count = regions.size();
+    select_largest();
+  }
+
+  update_tracks(follows_on);
+
+  // find the centres of the large regions - these are the track points
+  track_points.resize(num_spots);
+  for( int index=0; index<num_spots; ++index )
+    track_points[index] = largest[index]->centre();
+
+  return distinct_region_count;
+}
+
+
+/** Label a window of the frame, the regions found are added to regions in full frame coordinates */
+void SpotTracker::label(const TrackFrame &frame, const Rect &window, Mat &display_mask, vector<Region> &regions)
+{
+  size_t first_region = regions.size();
+
+  Mat display_mask_window;
+  if( !display_mask.empty() )
+    display_mask_window = display_mask(window);
+
+  if( chroma_table != NULL )
+  {
+    // windows start on a chroma sample, see track_windows()
+    int shift = (frame.cb.cols < frame.y.cols) ? 1 : 0;
+    int chroma_end_x = min( (window.x + window.width  + (1<<shift) - 1) >> shift, frame.cb.cols );
+    int chroma_end_y = min( (window.y + window.height + (1<<shift) - 1) >> shift, frame.cb.rows );
+
+    Rect chroma_window( window.x >> shift, window.y >> shift, chroma_end_x - (window.x >> shift), chroma_end_y - (window.y >> shift) );
+
+    label_chroma(frame.y(window), frame.cb(chroma_window), frame.cr(chroma_window), display_mask_window, regions);
+  }
+  else
+  {
+    label_bgr(frame.bgr(window), display_mask_window, regions);
+  }
+
+  if( window.x != 0 || window.y != 0 )
+  {
+    for( size_t index = first_region; index < regions.size(); ++index )
+      regions[index].translate(window.x, window.y);
+  }
+}
+
+
+/**
+ * Label the rows of an image, split into strips that are labelled in parallel if there are
+ * enough rows and more than one strip is set. label_rows(begin, end, labeler, row_mask) adds
+ * rows begin to end-1 to the labeler, the strips are then joined up across the seams so the
+ * regions come out exactly as if they had been labelled in one go.
+ */
+void SpotTracker::label_strips(int rows, vector<Region> &regions,
+                               const function<void(int, int, RunLabeler &, vector<SpotClassifier::MaskWord> &)> &label_rows)
+{
+  int strips = min( (int)strip_labelers.size(), rows / min_strip_rows );
+
+  if( strips <= 1 )
+  {
+    labeler.reset();
+    label_rows(0, rows, labeler, row_mask);
+
+    StageTimer timer(STAGE_RESOLVE);
+    labeler.resolve(regions);
+    return;
+  }
+
+  parallel_for_( Range(0, strips), StripLabeler( [&](int strip)
+  {
+    strip_labelers[strip].reset();
+    label_rows(rows*strip/strips, rows*(strip+1)/strips, strip_labelers[strip], strip_masks[strip]);
+  } ) );
+
+  StageTimer timer(STAGE_RESOLVE);
+
+  // seam merge
+  labeler.reset();
+  for( int strip=0; strip<strips; ++strip )
+    labeler.append( strip_labelers[strip] );
+
+  labeler.resolve(regions);
+}
+
+
+/**
+ * Find the connected regions of tracking spot pixels in the image -
+ * http://en.wikipedia.org/wiki/Connected-component_labeling
+ *
+ * Each row is classified into a bitmask and added to the labeler as runs of spot pixels, so
+ * whole words of background (most of every frame) are skipped without looking at the pixels
+ * individually. The distinct regions are added to regions.
+ */
+void SpotTracker::label_bgr(const Mat &image, Mat &display_mask, vector<Region> &regions)
+{
+  // picked once for the image rather than tested for every run
+  BgrRows label_rows = display_mask.empty() ? &SpotTracker::label_bgr_rows<false> : &SpotTracker::label_bgr_rows<true>;
+
+  label_strips( image.rows, regions, [&](int row_begin, int row_end, RunLabeler &labeler, vector<SpotClassifier::MaskWord> &row_mask)
+  {
+    (this->*label_rows)(image, row_begin, row_end, display_mask, labeler, row_mask);
+  } );
+}
+
+
+template<bool build_mask>
+void SpotTracker::label_bgr_rows(const Mat &image, int row_begin, int row_end, Mat &display_mask,
+                                 RunLabeler &labeler, vector<SpotClassifier::MaskWord> &row_mask) const
+{
+  row_mask.resize( SpotClassifier::mask_words(image.cols) );
+
+  // the stages alternate every row, their times are added up over the rows
+  int64 classify_ticks = 0;
+  int64 label_ticks = 0;
+
+  for( int row = row_begin; row < row_end; ++row )
+  {
+    const uchar *image_ptr = image.ptr(row);
+
+    int64 start = getTickCount();
+    classifier_.classify_row(image_ptr, image.cols, &row_mask[0]);  // assumes BGR
+    int64 classified = getTickCount();
+
+    int first_run = labeler.add_row(row, &row_mask[0], image.cols);
+
+    if( build_mask )
+    {
+      // display the colours of pixels deemed to be part of the tracking spot - useful for tuning
+      uchar *display_mask_ptr = display_mask.ptr(row);
+
+      for( int index = first_run; index < labeler.run_count(); ++index )
+      {
+        const RunLabeler::Run &run = labeler.run(index);
+        memcpy( display_mask_ptr + 3*run.start, image_ptr + 3*run.start, 3*(run.end - run.start) );
+      }
+    }
+
+    classify_ticks += classified - start;
+    label_ticks += getTickCount() - classified;
+  }
+
+  StageStats::record(STAGE_CLASSIFY, classify_ticks);
+  StageStats::record(STAGE_LABEL, label_ticks);
+}
+
+
+/**
+ * The same labeling as label_bgr() but done at the resolution of the chroma planes. Each run of
+ * candidate chroma samples is then refined against the full resolution luma - only the pixels
+ * it covers which pass the full colour test are counted, so the region totals are in full
+ * resolution coordinates.
+ */
+void SpotTracker::label_chroma(const Mat &y_plane, const Mat &cb_plane, const Mat &cr_plane,
+                               Mat &display_mask, vector<Region> &regions)
+{
+  // picked once for the image, the mask test would otherwise be made for every spot pixel
+  ChromaRows label_rows = display_mask.empty() ? &SpotTracker::label_chroma_rows<false> : &SpotTracker::label_chroma_rows<true>;
+
+  label_strips( cb_plane.rows, regions, [&](int row_begin, int row_end, RunLabeler &labeler, vector<SpotClassifier::MaskWord> &row_mask)
+  {
+    (this->*label_rows)(y_plane, cb_plane, cr_plane, row_begin, row_end, display_mask, labeler, row_mask);
+  } );
+}
+
+
+template<bool build_mask>
+void SpotTracker::label_chroma_rows(const Mat &y_plane, const Mat &cb_plane, const Mat &cr_plane, int row_begin, int row_end,
+                                    Mat &display_mask, RunLabeler &labeler, vector<SpotClassifier::MaskWord> &row_mask) const
+{
+  // luma pixels per chroma sample in each direction
+  int shift = (cb_plane.cols < y_plane.cols) ? 1 : 0;
+
+  row_mask.resize( SpotClassifier::mask_words(cb_plane.cols) );
+
+  // the stages alternate every row, their times are added up over the rows - the luma test of
+  // the candidates is counted as labeling
+  int64 classify_ticks = 0;
+  int64 label_ticks = 0;
+
+  for( int row = row_begin; row < row_end; ++row )
+  {
+    const uchar *cb_ptr = cb_plane.ptr(row);
+    const uchar *cr_ptr = cr_plane.ptr(row);
+
+    int64 start = getTickCount();
+
+    fill( row_mask.begin(), row_mask.end(), 0 );
+
+    for( int col=0; col < cb_plane.cols; ++col )
+    {
+      if( chroma_table->candidate(cb_ptr[col], cr_ptr[col]) )
+        row_mask[col >> 6] |= (SpotClassifier::MaskWord)1 << (col & 63);
+    }
+
+    int64 classified = getTickCount();
+
+    int first_run = labeler.add_row(row, &row_mask[0], cb_plane.cols);
+
+    // refine each run against the luma of the full resolution pixels it covers
+    int y_end = min( (row+1) << shift, y_plane.rows );
+
+    for( int index = first_run; index < labeler.run_count(); ++index )
+    {
+      const RunLabeler::Run &run = labeler.run(index);
+
+      Region &region = labeler.run_region(index);
+      region = Region();
+
+      for( int y = row << shift; y < y_end; ++y )
+      {
+        const uchar *y_ptr = y_plane.ptr(y);
+
+        for( int col = run.start; col < run.end; ++col )
+        {
+          int x_end = min( (col+1) << shift, y_plane.cols );
+
+          for( int x = col << shift; x < x_end; ++x )
+          {
+            uchar bgr[3];
+            ycbcr_to_bgr_pixel(y_ptr[x], cb_ptr[col], cr_ptr[col], bgr);
+
+            if( classifier_.is_spot(bgr) )
+            {
+              region.add_point(x, y);
+
+              if( build_mask )
+              {
+                uchar *display_mask_ptr = display_mask.ptr(y) + 3*x;
+                display_mask_ptr[0] = bgr[0];
+                display_mask_ptr[1] = bgr[1];
+                display_mask_ptr[2] = bgr[2];
+              }
+            }
+          }
+        }
+      }
+    }
+
+    classify_ticks += classified - start;
+    label_ticks += getTickCount() - classified;
+  }
+
+  StageStats::record(STAGE_CLASSIFY, classify_ticks);
+  StageStats::record(STAGE_LABEL, label_ticks);
+}
+
+
+/** Keep pointers to the largest distinct regions (which should be the spots), smallest first */
+void SpotTracker::select_largest()
+{
+  largest_regions(regions, largest, &empty_region);
+}
+
+
+/**
+ * Label a decimated copy of the frame (every pyramid_factor'th pixel of every pyramid_factor'th
+ * row) to find where the spots might be, the regions found are in coarse coordinates. Returns
+ * the number of full resolution pixels across each coarse pixel.
+ */
+int SpotTracker::label_coarse(const TrackFrame &frame, vector<Region> &coarse_regions)
+{
+  labeler.reset();
+
+  if( chroma_table != NULL )
+  {
+    // the chroma planes are already decimated, so step over fewer of their samples
+    int shift = (frame.cb.cols < frame.y.cols) ? 1 : 0;
+    int step = max( pyramid_factor >> shift, 1 );
+
+    int rows = coarse_samples(frame.cb.rows, step);
+    int cols = coarse_samples(frame.cb.cols, step);
+
+    row_mask.resize( SpotClassifier::mask_words(cols) );
+
+    int64 classify_ticks = 0;
+    int64 label_ticks = 0;
+
+    for( int row=0; row < rows; ++row )
+    {
+      const uchar *cb_ptr = frame.cb.ptr(row*step + step/2) + step/2;
+      const uchar *cr_ptr = frame.cr.ptr(row*step + step/2) + step/2;
+
+      int64 start = getTickCount();
+
+      fill( row_mask.begin(), row_mask.end(), 0 );
+
+      for( int col=0; col < cols; ++col )
+      {
+        if( chroma_table->candidate(cb_ptr[col*step], cr_ptr[col*step]) )
+          row_mask[col >> 6] |= (SpotClassifier::MaskWord)1 << (col & 63);
+      }
+
+      int64 classified = getTickCount();
+      labeler.add_row(row, &row_mask[0], cols);
+
+      classify_ticks += classified - start;
+      label_ticks += getTickCount() - classified;
+    }
+
+    StageStats::record(STAGE_CLASSIFY, classify_ticks);
+    StageStats::record(STAGE_LABEL, label_ticks);
+
+    StageTimer timer(STAGE_RESOLVE);
+    labeler.resolve(coarse_regions);
+
+    return step << shift;
+  }
+
+  int step = pyramid_factor;
+
+  int rows = coarse_samples(frame.bgr.rows, step);
+  int cols = coarse_samples(frame.bgr.cols, step);
+
+  coarse_row.resize(3*cols);
+  row_mask.resize( SpotClassifier::mask_words(cols) );
+
+  int64 classify_ticks = 0;
+  int64 label_ticks = 0;
+
+  for( int row=0; row < rows; ++row )
+  {
+    int64 start = getTickCount();
+
+    // gather the row's samples so the classifier can work on them as usual
+    const uchar *image_ptr = frame.bgr.ptr(row*step + step/2) + 3*(step/2);
+
+    for( int col=0; col < cols; ++col, image_ptr += 3*step )
+    {
+      coarse_row[3*col]   = image_ptr[0];
+      coarse_row[3*col+1] = image_ptr[1];
+      coarse_row[3*col+2] = image_ptr[2];
+    }
+
+    classifier_.classify_row(&coarse_row[0], cols, &row_mask[0]);
+
+    int64 classified = getTickCount();
+    labeler.add_row(row, &row_mask[0], cols);
+
+    classify_ticks += classified - start;
+    label_ticks += getTickCount() - classified;
+  }
+
+  StageStats::record(STAGE_CLASSIFY, classify_ticks);
+  StageStats::record(STAGE_LABEL, label_ticks);
+
+  StageTimer timer(STAGE_RESOLVE);
+  labeler.resolve(coarse_regions);
+
+  return step;
+}
+
+
+/**
+ * Find the spots without scanning the whole frame - candidate blobs big enough to be a spot are
+ * found in a decimated copy of the frame, then only a window around each is labelled at full
+ * resolution. Returns the number of distinct regions in the windows, or -1 if the spots weren't
+ * all found cleanly and the full frame needs scanning.
+ */
+int SpotTracker::acquire_coarse(const TrackFrame &frame, Mat &display_mask)
+{
+  coarse_regions.clear();
+  int factor = label_coarse(frame, coarse_regions);
+
+  int min_count = max( min_spot_area / (factor*factor), 1 );
+
+  // the samples are a coarse pixel apart, so a spot can reach up to one past its outer samples
+  int margin = factor + window_margin;
+
+  windows.clear();
+
+  for( size_t index=0; index < coarse_regions.size(); ++index )
+  {
+    if( coarse_regions[index].count() < min_count )
+      continue;
+
+    Rect bounds = coarse_regions[index].bounds();
+
+    add_window( Rect( bounds.x*factor - margin,
+                      bounds.y*factor - margin,
+                      bounds.width*factor  + 2*margin,
+                      bounds.height*factor + 2*margin ), frame.size() );
+  }
+
+  if( windows.empty() )
+    return -1;
+
+  // unlike tracking, windows with nothing but noise in them are expected
+  return label_windows(frame, display_mask, false);
+}
+
+
+/**
+ * Label only windows around the predicted spot positions. Returns the number of distinct regions
+ * in the windows, or -1 if the spots weren't all found cleanly and the full frame needs scanning.
+ */
+int SpotTracker::track_windows(const TrackFrame &frame, Mat &display_mask)
+{
+  windows.clear();
+
+  for( int index=0; index<num_spots; ++index )
+  {
+    const SpotTrack &spot = tracks[index];
+
+    Point2d predicted = spot.position + spot.velocity;
+
+    int margin_x = window_margin + cvCeil( fabs(spot.velocity.x) );
+    int margin_y = window_margin + cvCeil( fabs(spot.velocity.y) );
+
+    Rect window( cvFloor(predicted.x) - spot.size.width/2  - margin_x,
+                 cvFloor(predicted.y) - spot.size.height/2 - margin_y,
+                 spot.size.width  + 2*margin_x + 1,
+                 spot.size.height + 2*margin_y + 1 );
+
+    if( !add_window(window, frame.size()) )
+      return -1;   // predicted off the edge of the frame
+  }
+
+  return label_windows(frame, display_mask, true);
+}
+
+
+/** Add a window to be labelled, clipped to the frame. Returns false if nothing is left of it */
+bool SpotTracker::add_window(Rect window, const Size &frame_size)
+{
+  // start windows on a chroma sample so the planes line up
+  if( chroma_table != NULL )
+  {
+    window.width += window.x & 1;  window.x &= ~1;
+    window.height += window.y & 1; window.y &= ~1;
+  }
+
+  window &= Rect( Point(0, 0), frame_size );
+
+  if( window.area() == 0 )
+    return false;
+
+  windows.push_back(window);
+  return true;
+}
+
+
+/**
+ * Label the windows and pick out the spots. Returns the number of distinct regions in the
+ * windows, or -1 if there are too few, a spot runs into the inside edge of its window (so may
+ * carry on outside it) or, if spot_in_every_window, a window has lost its spot.
+ */
+int SpotTracker::label_windows(const TrackFrame &frame, Mat &display_mask, bool spot_in_every_window)
+{
+  Rect frame_rect( Point(0, 0), frame.size() );
+
+  // merge overlapping windows so nothing is labelled twice
+  for( size_t index=0; index < windows.size(); )
+  {
+    size_t other = index+1;
+    while( other < windows.size() && (windows[index] & windows[other]).area() == 0 )
+      ++other;
+
+    if( other < windows.size() )
+    {
+      windows[index] |= windows[other];
+      windows.erase( windows.begin() + other );
+      index = 0;   // the bigger window may now overlap one already checked
+    }
+    else
+    {
+      ++index;
+    }
+  }
+
+  regions.clear();
+  region_window.clear();
+
+  for( size_t index=0; index < windows.size(); ++index )
+  {
+    label(frame, windows[index], display_mask, regions);
+    region_window.resize(regions.size(), index);
+  }
+
+  int distinct_region_count = regions.size();
+  if( distinct_region_count < num_spots )
+    return -1;
+
+  select_largest();
+
+  vector<bool> window_has_spot(windows.size(), false);
+
+  for( int index=0; index<num_spots; ++index )
+  {
+    int window_index = region_window[ largest[index] - &regions[0] ];
+    const Rect &window = windows[window_index];
+    Rect bounds = largest[index]->bounds();
+
+    // a spot touching the edge of its window (but not the frame) may carry on outside it
+    if( (bounds.x == window.x && window.x > 0)
+        || (bounds.y == window.y && window.y > 0)
+        || (bounds.br().x == window.br().x && window.br().x < frame_rect.width)
+        || (bounds.br().y == window.br().y && window.br().y < frame_rect.height) )
+    {
+      return -1;
+    }
+
+    window_has_spot[window_index] = true;
+  }
+
+  // a window with no spot in it has lost its spot to something else
+  for( size_t index=0; spot_in_every_window && index < windows.size(); ++index )
+  {
+    if( !window_has_spot[index] )
+      return -1;
+  }
+
+  return distinct_region_count;
+}
+
+
+/** Match the spots found to the tracks they carry on from and update the predictions */
+void SpotTracker::update_tracks(bool follows_on)
+{
+  bool was_locked = locked && follows_on;
+
+  locked = largest[0]->count() > 0;   // the smallest is empty if too few were found
+
+  if( !windowed || !locked )
+    return;
+
+  if( !was_locked )
+  {
+    // start new tracks, standing still until the next frame
+    for( int index=0; index<num_spots; ++index )
+    {
+      tracks[index].position = largest[index]->centre();
+      tracks[index].velocity = Point2d(0, 0);
+      tracks[index].size = largest[index]->bounds().size();
+    }
+
+    return;
+  }
+
+  vector<bool> taken(num_spots, false);
+
+  for( int index=0; index<num_spots; ++index )
+  {
+    SpotTrack &spot = tracks[index];
+
+    // the closest spot to the prediction, or any spot for a new track
+    Point2d predicted = spot.position + spot.velocity;
+
+    int closest = -1;
+    double closest_distance = 0;
+
+    for( int candidate=0; candidate<num_spots; ++candidate )
+    {
+      Point2d offset = largest[candidate]->centre() - predicted;
+      double distance = offset.x*offset.x + offset.y*offset.y;
+
+      if( !taken[candidate] && (closest < 0 || distance < closest_distance) )
+      {
+        closest = candidate;
+        closest_distance = distance;
+      }
+    }
+
+    taken[closest] = true;
+
+    const Region &region = *largest[closest];
+
+    spot.velocity = region.centre() - spot.position;
+    spot.position = region.centre();
+    spot.size = region.bounds().size();
+  }
+}
@@ -0,0 +1,164 @@
+#ifndef SPOTTRACKER_H
+#define SPOTTRACKER_H
+
+#include <vector>
+#include <functional>
+
+#include <opencv2/opencv.hpp>
+
+#include "regionlabeler.h"
+#include "spotclassifier.h"
+
+
+/** A frame to track - a BGR image, or the Y/Cb/Cr planes of a 4:2:0 stream for chroma tracking */
+struct TrackFrame
+{
+  cv::Mat bgr;
+  cv::Mat y, cb, cr;
+
+  cv::Size size() const { return bgr.empty() ? y.size() : bgr.size(); }
+};
+
+
+/**
+ * The chroma only part of the spot colour test for detecting spots on 4:2:0 planes. The colour
+ * differences the tracking spot test looks at hardly depend on the luma, so a Cb/Cr pair is
+ * marked as a candidate if any luma value would make the pixel a tracking spot.
+ */
+class ChromaSpotTable
+{
+  public:
+    ChromaSpotTable(const SpotClassifier &classifier);
+
+    bool candidate(unsigned char cb, unsigned char cr) const { return table[cb][cr]; }
+
+  private:
+    bool table[256][256];
+};
+
+
+/**
+ * Finds the tracking spots in each frame - the centres of the largest distinct regions of spot
+ * coloured pixels.
+ *
+ * In windowed mode the spots found in the last frame are followed with a constant velocity
+ * prediction and only a window around each predicted spot is labelled. The full frame is
+ * scanned again whenever the windows lose a spot, a spot runs into the edge of its window, or
+ * there are fewer regions than spots. Frames which don't directly follow the last one tracked
+ * (e.g. after seeking) are always scanned in full.
+ *
+ * With a pyramid factor above 1 the full frame scans are done coarse to fine - a copy of the
+ * frame decimated by the factor is labelled to find candidate spots and only windows around
+ * them are labelled at full resolution. The whole frame is only labelled if that fails.
+ *
+ * Large areas can also be labelled as horizontal strips in parallel (with cv::parallel_for_),
+ * which gives exactly the same regions as labelling them in one go.
+ */
+class SpotTracker
+{
+  public:
+    /** The spot colour is tested with the colour table if there is one, otherwise the thresholds */
+    SpotTracker(int num_spots, const SpotThresholds &thresholds, bool chroma_planes=false, const SpotColourTable *colour_table=NULL);
+
+    /** Test the spot colour with a particular classifier, e.g. to compare the kernels */
+    SpotTracker(int num_spots, const SpotClassifier &classifier, bool chroma_planes=false);
+    ~SpotTracker();
+
+    void set_windowed(bool windowed) { this->windowed = windowed; locked = false; }
+
+    /** Decimation of the coarse search for spots, 1 to always label the full frame */
+    void set_pyramid_factor(int factor) { pyramid_factor = factor; }
+
+    /** Most strips to label an image in at once, 1 to label on the calling thread */
+    void set_strips(int strips) { strip_labelers.resize(strips); strip_masks.resize(strips); }
+
+    /**
+     * Track a frame, the display mask is filled in with the spot pixels (on top of whatever is
+     * already in it) unless it is empty. The centres of the largest num_spots regions are put
+     * into track_points, largest last. If too few were found the rest are the centre of an
+     * empty region (NaN). Returns the number of distinct regions found.
+     */
+    int track(int frame_num, const TrackFrame &frame, cv::Mat &display_mask, std::vector<cv::Point2d> &track_points);
+
+    const SpotClassifier &classifier() const { return classifier_; }
+
+    bool uses_chroma_planes() const { return chroma_table != NULL; }
+
+    int full_scans() const { return full_scan_count; }
+    int coarse_scans() const { return coarse_scan_count; }
+
+  private:
+    void label(const TrackFrame &frame, const cv::Rect &window, cv::Mat &display_mask, std::vector<Region> &regions);
+    void label_strips(int rows, std::vector<Region> &regions,
+                      const std::function<void(int, int, RunLabeler &, std::vector<SpotClassifier::MaskWord> &)> &label_rows);
+
+    // the row labeling is instantiated with and without the display mask being built, so the
+    // loops over the pixels don't test for it
+    typedef void (SpotTracker::*BgrRows)(const cv::Mat &, int, int, cv::Mat &,
+                                         RunLabeler &, std::vector<SpotClassifier::MaskWord> &) const;
+    typedef void (SpotTracker::*ChromaRows)(const cv::Mat &, const cv::Mat &, const cv::Mat &, int, int,
+                                            cv::Mat &, RunLabeler &, std::vector<SpotClassifier::MaskWord> &) const;
+
+    void label_bgr(const cv::Mat &image, cv::Mat &display_mask, std::vector<Region> &regions);
+    template<bool build_mask>
+    void label_bgr_rows(const cv::Mat &image, int row_begin, int row_end, cv::Mat &display_mask,
+                        RunLabeler &labeler, std::vector<SpotClassifier::MaskWord> &row_mask) const;
+
+    void label_chroma(const cv::Mat &y_plane, const cv::Mat &cb_plane, const cv::Mat &cr_plane,
+                      cv::Mat &display_mask, std::vector<Region> &regions);
+    template<bool build_mask>
+    void label_chroma_rows(const cv::Mat &y_plane, const cv::Mat &cb_plane, const cv::Mat &cr_plane, int row_begin, int row_end,
+                           cv::Mat &display_mask, RunLabeler &labeler, std::vector<SpotClassifier::MaskWord> &row_mask) const;
+
+    void select_largest();
+
+    int label_coarse(const TrackFrame &frame, std::vector<Region> &coarse_regions);
+    int acquire_coarse(const TrackFrame &frame, cv::Mat &display_mask);
+
+    int track_windows(const TrackFrame &frame, cv::Mat &display_mask);
+    bool add_window(cv::Rect window, const cv::Size &frame_size);
+    int label_windows(const TrackFrame &frame, cv::Mat &display_mask, bool spot_in_every_window);
+    void update_tracks(bool follows_on);
+
+    int num_spots;
+
+    SpotClassifier classifier_;
+    ChromaSpotTable *chroma_table;   // only used when tracking on the chroma planes
+
+    std::vector<SpotClassifier::MaskWord> row_mask;   // classified pixels of the current row
+    RunLabeler labeler;
+
+    // labelers and row masks for each strip when labelling in parallel
+    std::vector<RunLabeler> strip_labelers;
+    std::vector< std::vector<SpotClassifier::MaskWord> > strip_masks;
+
+    std::vector<Region> regions;           // distinct regions found
+    std::vector<const Region *> largest;   // pointers for the largest distinct regions
+    Region empty_region;
+
+    // windowed tracking
+    struct SpotTrack
+    {
+      cv::Point2d position;
+      cv::Point2d velocity;   // per frame
+      cv::Size size;
+    };
+
+    bool windowed;
+    bool locked;      // all the spots were found in the last frame tracked
+    int last_frame;
+
+    std::vector<SpotTrack> tracks;
+    std::vector<cv::Rect> windows;
+    std::vector<int> region_window;   // window each region was found in
+
+    // coarse to fine search
+    int pyramid_factor;
+    std::vector<unsigned char> coarse_row;   // decimated BGR row
+    std::vector<Region> coarse_regions;
+
+    int full_scan_count;
+    int coarse_scan_count;
+};
+
+#endif // SPOTTRACKER_H
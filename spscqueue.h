@@ -0,0 +1,82 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+
+/**
+ * Bounded lock-free queue for passing items from one thread to one other thread. The producer
+ * only moves the tail and the consumer only moves the head, so all that is needed is for each
+ * to see the other's slot updates before the index that publishes them. One slot is always
+ * left empty to tell a full queue from an empty one.
+ */
+template<typename T>
+class SpscQueue
+{
+  public:
+    SpscQueue(size_t capacity) : slots(capacity+1), head(0), tail(0) {}
+
+    /** Add an item (producer only), false if the queue is full */
+    bool try_push(const T &item)
+    {
+      size_t slot = tail.load(std::memory_order_relaxed);
+      size_t next = (slot + 1) % slots.size();
+
+      if( next == head.load(std::memory_order_acquire) )
+        return false;
+
+      slots[slot] = item;
+      tail.store(next, std::memory_order_release);
+      return true;
+    }
+
+    /** Take the oldest item (consumer only), false if the queue is empty */
+    bool try_pop(T &item)
+    {
+      size_t slot = head.load(std::memory_order_relaxed);
+
+      if( slot == tail.load(std::memory_order_acquire) )
+        return false;
+
+      item = slots[slot];
+      slots[slot] = T();   // don't hold on to anything the item owns
+
+      head.store((slot + 1) % slots.size(), std::memory_order_release);
+      return true;
+    }
+
+    /** Add an item, waiting for space */
+    void push(const T &item)
+    {
+      for( int tries=0; !try_push(item); ++tries )
+        backoff(tries);
+    }
+
+    /** Take the oldest item, waiting for one to arrive */
+    void pop(T &item)
+    {
+      for( int tries=0; !try_pop(item); ++tries )
+        backoff(tries);
+    }
+
+    static void backoff(int tries)
+    {
+      // spin briefly for the usual short waits, then stop burning a core
+      if( tries < 64 )
+        std::this_thread::yield();
+      else
+        std::this_thread::sleep_for( std::chrono::microseconds(200) );
+    }
+
+  private:
+    std::vector<T> slots;
+
+    // on separate cache lines so the two threads don't fight over them
+    alignas(64) std::atomic<size_t> head;   // next slot to pop
+    alignas(64) std::atomic<size_t> tail;   // next slot to push
+};
+
+#endif // SPSCQUEUE_H
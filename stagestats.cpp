@@ -0,0 +1,244 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Graeme Hattan                                   *
+ *   graemeh.dev@googlemail.com                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <vector>
+
+#include "stagestats.h"
+
+using namespace std;
+using namespace cv;
+
+
+namespace
+{
+  const int num_buckets = 256;   // 4 per doubling of the time in ns, up to 2^64
+
+  /**
+   * One thread's counts for a stage. Only the owning thread writes them, so plain loads and
+   * stores are enough (no locked adds) - they are atomic so a report can read them at any time.
+   */
+  struct StageCounts
+  {
+    StageCounts()
+    {
+      count.store(0);
+      total_ns.store(0);
+      max_ns.store(0);
+
+      for( int bucket=0; bucket < num_buckets; ++bucket )
+        buckets[bucket].store(0);
+    }
+
+    atomic<uint64_t> count;
+    atomic<uint64_t> total_ns;
+    atomic<uint64_t> max_ns;
+    atomic<uint32_t> buckets[num_buckets];
+  };
+
+  struct ThreadStats
+  {
+    StageCounts stages[STAGE_COUNT];
+  };
+
+  // every thread that has recorded anything - never freed, the counts outlive the threads
+  mutex threads_mutex;
+  vector<ThreadStats *> threads;
+
+  ThreadStats &this_thread_stats()
+  {
+    static thread_local ThreadStats *stats = NULL;
+
+    if( stats == NULL )
+    {
+      stats = new ThreadStats();
+
+      lock_guard<mutex> lock(threads_mutex);
+      threads.push_back(stats);
+    }
+
+    return *stats;
+  }
+
+  inline void add(atomic<uint64_t> &counter, uint64_t value)
+  {
+    counter.store( counter.load(memory_order_relaxed) + value, memory_order_relaxed );
+  }
+
+  /** The doubling the time is in and which quarter of it */
+  int bucket_of(uint64_t ns)
+  {
+    if( ns < 4 )
+      return ns;
+
+    int octave = 63 - __builtin_clzll(ns);
+    return octave*4 + ((ns >> (octave-2)) & 3);
+  }
+
+  /** Upper end of a bucket's times */
+  double bucket_top(int bucket)
+  {
+    if( bucket < 4 )
+      return bucket;
+
+    int octave = bucket / 4;
+    return ldexp( 4 + bucket%4 + 1, octave-2 );
+  }
+
+  /** A stage combined over all the threads, in ms */
+  struct Summary
+  {
+    uint64_t count;
+    double mean;
+    double p50;
+    double p99;
+    double max;
+    double total;
+  };
+
+  Summary summarise(Stage stage)
+  {
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    vector<uint64_t> buckets(num_buckets, 0);
+
+    {
+      lock_guard<mutex> lock(threads_mutex);
+
+      for( size_t index=0; index < threads.size(); ++index )
+      {
+        const StageCounts &counts = threads[index]->stages[stage];
+
+        count += counts.count.load(memory_order_relaxed);
+        total_ns += counts.total_ns.load(memory_order_relaxed);
+        max_ns = max( max_ns, counts.max_ns.load(memory_order_relaxed) );
+
+        for( int bucket=0; bucket < num_buckets; ++bucket )
+          buckets[bucket] += counts.buckets[bucket].load(memory_order_relaxed);
+      }
+    }
+
+    Summary summary = { count, 0, 0, 0, max_ns * 1e-6, total_ns * 1e-6 };
+    if( count == 0 )
+      return summary;
+
+    summary.mean = summary.total / count;
+
+    // the percentiles are the top of the bucket they fall in, no more than the max
+    uint64_t seen = 0;
+    bool have_p50 = false;
+
+    for( int bucket=0; bucket < num_buckets; ++bucket )
+    {
+      seen += buckets[bucket];
+
+      if( !have_p50 && seen*2 >= count )
+      {
+        summary.p50 = min( bucket_top(bucket) * 1e-6, summary.max );
+        have_p50 = true;
+      }
+
+      if( seen*100 >= count*99 )
+      {
+        summary.p99 = min( bucket_top(bucket) * 1e-6, summary.max );
+        break;
+      }
+    }
+
+    return summary;
+  }
+}
+
+
+const char *StageStats::stage_name(Stage stage)
+{
+  static const char *names[STAGE_COUNT] = {
+    "load", "undistort", "classify", "label", "resolve", "draw", "display", "image write", "mat write"
+  };
+
+  return names[stage];
+}
+
+
+void StageStats::record(Stage stage, int64_t ticks)
+{
+  static const double ns_per_tick = 1e9 / getTickFrequency();
+
+  uint64_t ns = max( ticks, (int64_t)0 ) * ns_per_tick;
+  StageCounts &counts = this_thread_stats().stages[stage];
+
+  add(counts.count, 1);
+  add(counts.total_ns, ns);
+
+  if( ns > counts.max_ns.load(memory_order_relaxed) )
+    counts.max_ns.store(ns, memory_order_relaxed);
+
+  atomic<uint32_t> &bucket = counts.buckets[ bucket_of(ns) ];
+  bucket.store( bucket.load(memory_order_relaxed) + 1, memory_order_relaxed );
+}
+
+
+void StageStats::report(ostream &out, int frames, double seconds)
+{
+  ios::fmtflags flags = out.flags();
+  streamsize precision = out.precision();
+
+  out << left << setw(12) << "stage (ms)" << right << setw(10) << "count"
+      << setw(10) << "mean" << setw(10) << "p50" << setw(10) << "p99" << setw(10) << "max" << endl;
+
+  out << fixed << setprecision(3);
+
+  for( int stage=0; stage < STAGE_COUNT; ++stage )
+  {
+    Summary summary = summarise((Stage)stage);
+    if( summary.count == 0 )
+      continue;
+
+    out << left << setw(12) << stage_name((Stage)stage) << right << setw(10) << summary.count
+        << setw(10) << summary.mean << setw(10) << summary.p50 << setw(10) << summary.p99 << setw(10) << summary.max << endl;
+  }
+
+  out << setprecision(2) << frames << " images in " << seconds << " s, " << frames / max(seconds, 1e-9) << " frames/s" << endl;
+
+  out.flags(flags);
+  out.precision(precision);
+}
+
+
+bool StageStats::write_csv(const string &file_name, int frames, double seconds)
+{
+  ofstream csv(file_name.c_str());
+  if( !csv )
+  {
+    cerr << "Error: Failed opening " << file_name << endl;
+    return false;
+  }
+
+  csv << "stage,count,mean_ms,p50_ms,p99_ms,max_ms,total_ms" << endl;
+
+  for( int stage=0; stage < STAGE_COUNT; ++stage )
+  {
+    Summary summary = summarise((Stage)stage);
+
+    csv << stage_name((Stage)stage) << ',' << summary.count << ',' << summary.mean << ',' << summary.p50 << ','
+        << summary.p99 << ',' << summary.max << ',' << summary.total << endl;
+  }
+
+  // the run overall as a stage of its own
+  csv << "frames," << frames << ",,,,," << seconds*1000 << endl;
+
+  return csv.good();
+}
@@ -0,0 +1,60 @@
+#ifndef STAGESTATS_H
+#define STAGESTATS_H
+
+#include <stdint.h>
+
+#include <iostream>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+/** The stages of tracking an image that are timed */
+enum Stage
+{
+  STAGE_LOAD,          // reading and decoding
+  STAGE_UNDISTORT,
+  STAGE_CLASSIFY,      // deciding which pixels are spot coloured
+  STAGE_LABEL,         // adding the runs of spot pixels to the labeler
+  STAGE_RESOLVE,       // joining strips and resolving the label equivalences into regions
+  STAGE_DRAW,
+  STAGE_DISPLAY,
+  STAGE_IMAGE_WRITE,   // encoding the video
+  STAGE_MAT_WRITE,
+  STAGE_COUNT
+};
+
+
+/**
+ * Times spent in each stage. Every thread records into its own counters and histogram (four
+ * buckets per doubling of the time), so recording needs no locking and costs a few adds. The
+ * threads' counts are only combined for a report, which can be made while they are running.
+ */
+class StageStats
+{
+  public:
+    /** Add a time, in cv::getTickCount() ticks, to a stage for the calling thread */
+    static void record(Stage stage, int64_t ticks);
+
+    /** Print the count, mean, p50, p99 and max of each stage and the frames/s overall */
+    static void report(std::ostream &out, int frames, double seconds);
+
+    /** Write the same as report() as CSV, one line per stage, false if it can't be written */
+    static bool write_csv(const std::string &file_name, int frames, double seconds);
+
+    static const char *stage_name(Stage stage);
+};
+
+
+/** Times a stage from construction to destruction */
+class StageTimer
+{
+  public:
+    StageTimer(Stage stage) : stage(stage), start(cv::getTickCount()) {}
+    ~StageTimer() { StageStats::record(stage, cv::getTickCount() - start); }
+
+  private:
+    Stage stage;
+    int64_t start;
+};
+
+#endif // STAGESTATS_H
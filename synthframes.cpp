@@ -0,0 +1,344 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Graeme Hattan                                   *
+ *   graemeh.dev@googlemail.com                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <iostream>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include "imageloader.h"
+#include "synthframes.h"
+#include "y4mreader.h"
+
+using namespace std;
+using namespace cv;
+
+
+// the leg, as fractions of the frame height - a stride takes stride_fields fields (a second)
+static const double hip_height = 0.16;
+static const double upper_length = 0.39;
+static const double lower_length = 0.36;
+static const double leg_width = 0.08;
+static const double motor_radius = 0.05;
+static const double spot_radius = 0.022;
+static const int stride_fields = 50;
+
+// the spots along the upper leg - either side of the motor, their mid-point is the centre of the leg
+static const double upper_spots[2] = { 0.3, 0.75 };
+
+// spot, border, leg and motor colours (BGR)
+static const Scalar spot_colour(50, 40, 190);
+static const Scalar border_colour(235, 235, 235);
+static const Scalar leg_colour(200, 195, 190);
+static const Scalar motor_colour(60, 55, 55);
+
+// clutter colours - each only just fails the spot colour test, so the noise makes some of
+// their pixels pass
+static const Scalar clutter_colours[] = { Scalar(60, 105, 110), Scalar(200, 60, 190), Scalar(20, 205, 212),
+                                          Scalar(175, 150, 170), Scalar(70, 50, 58) };
+
+// fraction the shadow darkens by
+static const double shadow_level = 0.6;
+
+// sub-pixel bits for drawing
+static const int draw_shift = 4;
+
+
+static inline Point fixed_point(const Point2d &point)
+{
+  return Point( cvRound(point.x * (1 << draw_shift)), cvRound(point.y * (1 << draw_shift)) );
+}
+
+
+static inline int fixed_length(double length)
+{
+  return cvRound( length * (1 << draw_shift) );
+}
+
+
+static bool highest(const Point2d &p1, const Point2d &p2) { return p1.y < p2.y; }
+
+
+
+SyntheticFootage::Settings SyntheticFootage::default_settings()
+{
+  Settings settings;
+  settings.size = Size(512, 192);
+  settings.noise = 4;
+  settings.shadows = true;
+  settings.clutter = 20;
+  settings.seed = 1;
+
+  return settings;
+}
+
+
+SyntheticFootage::SyntheticFootage(const Settings &settings) :
+  settings(settings)
+{
+  int width = settings.size.width;
+  int height = settings.size.height * 2;
+
+  // a dull blue-grey gradient, nowhere near spot coloured
+  background.create(height, width, CV_8UC3);
+  for( int row=0; row < height; ++row )
+  {
+    double depth = (double)row / height;
+    background.row(row).setTo( Scalar(120 + 40*depth, 125 + 30*depth, 115 + 25*depth) );
+  }
+
+  // the clutter stays put, the same for every frame
+  RNG rng(settings.seed);
+  int colour_count = sizeof(clutter_colours) / sizeof(clutter_colours[0]);
+
+  for( int index=0; index < settings.clutter; ++index )
+  {
+    Point centre( rng.uniform(0, width), rng.uniform(0, height) );
+    int size = rng.uniform( height / 50 + 1, height / 12 + 2 );
+    const Scalar &colour = clutter_colours[ rng.uniform(0, colour_count) ];
+
+    if( rng.uniform(0, 2) == 0 )
+      circle(background, centre, size, colour, CV_FILLED);
+    else
+      rectangle(background, Rect(centre.x - size, centre.y - size/2, 2*size, size), colour, CV_FILLED);
+  }
+}
+
+
+void SyntheticFootage::leg(int field_num, Point2d spots[4], Point2d joints[3]) const
+{
+  double height = settings.size.height * 2;
+  double phase = 2 * CV_PI * field_num / stride_fields;
+
+  // the upper leg swings either side of vertical and the knee bends on the way forward
+  double upper_angle = 0.45 * sin(phase);
+  double lower_angle = upper_angle - 0.35 * (1 - cos(phase));
+
+  Point2d upper( sin(upper_angle), cos(upper_angle) );
+  Point2d lower( sin(lower_angle), cos(lower_angle) );
+
+  joints[0] = Point2d( settings.size.width / 2.0, height * (hip_height + 0.02 * sin(2*phase)) );
+  joints[1] = joints[0] + upper * (upper_length * height);
+  joints[2] = joints[1] + lower * (lower_length * height);
+
+  spots[0] = joints[0] + upper * (upper_spots[0] * upper_length * height);
+  spots[1] = joints[0] + upper * (upper_spots[1] * upper_length * height);
+  spots[2] = joints[1];
+  spots[3] = joints[1] + lower * (0.5 * lower_length * height);
+}
+
+
+void SyntheticFootage::render_frame(int field_num, Mat &frame) const
+{
+  double height = settings.size.height * 2;
+
+  Point2d spots[4];
+  Point2d joints[3];
+  leg(field_num, spots, joints);
+
+  background.copyTo(frame);
+
+  int thickness = cvRound(leg_width * height);
+  line(frame, fixed_point(joints[0]), fixed_point(joints[1]), leg_colour, thickness, CV_AA, draw_shift);
+  line(frame, fixed_point(joints[1]), fixed_point(joints[2]), leg_colour, thickness, CV_AA, draw_shift);
+
+  circle(frame, fixed_point(joints[0]), fixed_length(motor_radius * height), motor_colour, CV_FILLED, CV_AA, draw_shift);
+  circle(frame, fixed_point(joints[1]), fixed_length(motor_radius * height), motor_colour, CV_FILLED, CV_AA, draw_shift);
+
+  // each spot has a white border, as recommended for the real thing
+  for( int index=0; index<4; ++index )
+  {
+    circle(frame, fixed_point(spots[index]), fixed_length(1.4 * spot_radius * height), border_colour, CV_FILLED, CV_AA, draw_shift);
+    circle(frame, fixed_point(spots[index]), fixed_length(spot_radius * height), spot_colour, CV_FILLED, CV_AA, draw_shift);
+  }
+
+  if( settings.shadows )
+  {
+    // cast by the knee motor, across the knee spot and down the lower leg
+    Mat shadow = Mat::zeros(frame.size(), CV_8UC1);
+    Point2d centre = joints[1] + Point2d(0.06 * height, 0.08 * height);
+    ellipse(shadow, fixed_point(centre), Size(fixed_length(0.12 * height), fixed_length(0.07 * height)),
+            30, 0, 360, Scalar::all(255), CV_FILLED, 8, draw_shift);
+
+    Mat darker = frame * shadow_level;
+    darker.copyTo(frame, shadow);
+  }
+}
+
+
+void SyntheticFootage::render(int field_num, Mat &bgr, vector<Point2d> &spots) const
+{
+  int parity = field_num % 2;
+
+  Mat frame;
+  render_frame(field_num, frame);
+  field_lines(frame, parity).copyTo(bgr);
+
+  if( settings.noise > 0 )
+  {
+    // different for every field, but the same every time the field is rendered
+    RNG rng( settings.seed * 7919u + field_num );
+
+    Mat noise(bgr.size(), CV_16SC3);
+    rng.fill(noise, RNG::NORMAL, Scalar::all(0), Scalar::all(settings.noise));
+
+    Mat noisy;
+    add(bgr, noise, noisy, noArray(), CV_8UC3);
+    bgr = noisy;
+  }
+
+  Point2d frame_spots[4];
+  Point2d joints[3];
+  leg(field_num, frame_spots, joints);
+
+  // the field's line n is line 2n + parity of the frame
+  spots.resize(4);
+  for( int index=0; index<4; ++index )
+    spots[index] = Point2d( frame_spots[index].x, (frame_spots[index].y - parity) / 2 );
+
+  sort(spots.begin(), spots.end(), highest);
+}
+
+
+bool SyntheticFootage::write_ppm(const string &dir, int count) const
+{
+  Mat bgr;
+  vector<Point2d> spots;
+
+  for( int field_num=0; field_num < count; ++field_num )
+  {
+    render(field_num, bgr, spots);
+
+    string file_name = dir + "/" + ImageLoader::file_num_to_name(field_num);
+    if( !imwrite(file_name, bgr) )
+    {
+      cerr << "Error: Failed writing " << file_name << endl;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool SyntheticFootage::write_y4m(const string &file_name, int count) const
+{
+  FILE *file = fopen(file_name.c_str(), "wb");
+  if( file == NULL )
+  {
+    cerr << "Error: Failed opening " << file_name << endl;
+    return false;
+  }
+
+  int width = settings.size.width;
+  int height = settings.size.height * 2;
+
+  fprintf(file, "YUV4MPEG2 W%d H%d F25:1 It A1:1 C420jpeg\n", width, height);
+
+  Mat y(height, width, CV_8UC1);
+  Mat cb(height/2, width/2, CV_8UC1);
+  Mat cr(height/2, width/2, CV_8UC1);
+
+  Mat field;
+  vector<Point2d> spots;
+  bool written = true;
+
+  for( int frame_num=0; frame_num < count/2 && written; ++frame_num )
+  {
+    // the top field then the bottom, each with its own lines of chroma as in interlaced 4:2:0
+    for( int parity=0; parity<2; ++parity )
+    {
+      render(frame_num*2 + parity, field, spots);
+
+      for( int row=0; row < field.rows; ++row )
+      {
+        const uchar *bgr = field.ptr(row);
+        uchar *y_ptr = y.ptr(row*2 + parity);
+
+        for( int col=0; col < width; ++col, bgr += 3 )   // ITU-R BT.601 studio range
+          y_ptr[col] = saturate_cast<uchar>( 16 + (24.966*bgr[0] + 128.553*bgr[1] + 65.481*bgr[2]) / 255 );
+      }
+
+      for( int row=0; row < field.rows/2; ++row )
+      {
+        uchar *cb_ptr = cb.ptr(row*2 + parity);
+        uchar *cr_ptr = cr.ptr(row*2 + parity);
+
+        for( int col=0; col < width/2; ++col )
+        {
+          // average the 2x2 block of the field
+          double blue = 0, green = 0, red = 0;
+          for( int dy=0; dy<2; ++dy )
+          {
+            const uchar *bgr = field.ptr(row*2 + dy) + 6*col;
+            blue  += bgr[0] + bgr[3];
+            green += bgr[1] + bgr[4];
+            red   += bgr[2] + bgr[5];
+          }
+
+          blue /= 4; green /= 4; red /= 4;
+
+          cb_ptr[col] = saturate_cast<uchar>( 128 + (112.0*blue - 74.203*green - 37.797*red) / 255 );
+          cr_ptr[col] = saturate_cast<uchar>( 128 + (-18.214*blue - 93.786*green + 112.0*red) / 255 );
+        }
+      }
+    }
+
+    written = fputs("FRAME\n", file) >= 0
+           && fwrite(y.data, 1, y.total(), file) == y.total()
+           && fwrite(cb.data, 1, cb.total(), file) == cb.total()
+           && fwrite(cr.data, 1, cr.total(), file) == cr.total();
+  }
+
+  if( fclose(file) != 0 || !written )
+  {
+    cerr << "Error: Failed writing " << file_name << endl;
+    return false;
+  }
+
+  return true;
+}
+
+
+
+string make_scratch_dir(const string &parent, const string &prefix)
+{
+  string dir_template = parent + "/" + prefix + ".XXXXXX";
+  vector<char> dir_name( dir_template.begin(), dir_template.end() );
+  dir_name.push_back('\0');
+
+  if( mkdtemp(&dir_name[0]) == NULL )
+  {
+    cerr << "Error: Failed creating a scratch directory in " << parent << endl;
+    return string();
+  }
+
+  return string(&dir_name[0]) + '/';
+}
+
+
+void remove_scratch_dir(const string &dir)
+{
+  DIR *handle = opendir(dir.c_str());
+  if( handle == NULL )
+    return;
+
+  for( struct dirent *entry; (entry = readdir(handle)) != NULL; )
+  {
+    if( entry->d_type == DT_REG )
+      unlink( (dir + entry->d_name).c_str() );
+  }
+
+  closedir(handle);
+  rmdir( dir.c_str() );
+}
@@ -0,0 +1,64 @@
+#ifndef SYNTHFRAMES_H
+#define SYNTHFRAMES_H
+
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+/**
+ * Renders synthetic runbot footage to measure and check the tracker against - video fields of
+ * a leg walking back and forth with the four tracking spots on it (two on the upper leg, the
+ * knee and the lower leg), over a background with optional noise, shadows and clutter. Every
+ * image is made from the field number and the settings alone, so the same settings always
+ * give the same footage, and the true centres of the spots are known.
+ */
+class SyntheticFootage
+{
+  public:
+    struct Settings
+    {
+      cv::Size size;      // of each field, the frames are twice the height
+      double noise;       // standard deviation of the gaussian noise added to each channel
+      bool shadows;       // a shadow moving with the leg, darkening the spots it crosses
+      int clutter;        // shapes in the background, all nearly but not quite spot coloured
+      unsigned seed;      // for the clutter and noise
+    };
+
+    /** 512x192 fields, a little noise, shadows and clutter */
+    static Settings default_settings();
+
+    explicit SyntheticFootage(const Settings &settings=default_settings());
+
+    cv::Size size() const { return settings.size; }
+
+    /**
+     * Render a field, the even numbered fields are the top fields. The true centres of the
+     * spots are put into spots in field coordinates, sorted by their y-values.
+     */
+    void render(int field_num, cv::Mat &bgr, std::vector<cv::Point2d> &spots) const;
+
+    /** Write fields 0 to count-1 as xxxxxxxx.ppm files in a directory, false on failure */
+    bool write_ppm(const std::string &dir, int count) const;
+
+    /** Write fields 0 to count-1 as an interlaced 4:2:0 YUV4MPEG2 stream, false on failure */
+    bool write_y4m(const std::string &file_name, int count) const;
+
+  private:
+    /** The spots of the leg at a time (in fields), in frame coordinates */
+    void leg(int field_num, cv::Point2d spots[4], cv::Point2d joints[3]) const;
+
+    void render_frame(int field_num, cv::Mat &frame) const;
+
+    Settings settings;
+    cv::Mat background;   // frame sized, with the clutter
+};
+
+
+/** Make a new directory in parent for scratch files, returns its path with a trailing slash - empty on failure */
+std::string make_scratch_dir(const std::string &parent, const std::string &prefix);
+
+/** Remove a scratch directory and the files in it */
+void remove_scratch_dir(const std::string &dir);
+
+#endif // SYNTHFRAMES_H
@@ -0,0 +1,567 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Graeme Hattan                                   *
+ *   graemeh.dev@googlemail.com                                            *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <iostream>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "y4mreader.h"
+
+using namespace std;
+using namespace cv;
+
+
+Y4mReader::Y4mReader() :
+  map(NULL),
+  map_size(0),
+  width_(0),
+  height_(0),
+  chroma_shift_(1),
+  interlacing('p')
+{
+}
+
+
+Y4mReader::~Y4mReader()
+{
+  close();
+}
+
+
+bool Y4mReader::open(const string &file_name)
+{
+  close();
+
+  this->file_name = file_name;
+
+  int fd = ::open(file_name.c_str(), O_RDONLY);
+  if( fd < 0 )
+  {
+    cerr << "Error: Failed opening " << file_name << endl;
+    return false;
+  }
+
+  struct stat file_stat;
+  if( fstat(fd, &file_stat) != 0 || file_stat.st_size == 0 )
+  {
+    cerr << "Error: Failed reading the size of " << file_name << endl;
+    ::close(fd);
+    return false;
+  }
+
+  map_size = file_stat.st_size;
+  void *mapping = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);   // the mapping keeps its own reference to the file
+
+  if( mapping == MAP_FAILED )
+  {
+    cerr << "Error: Failed mapping " << file_name << endl;
+    map_size = 0;
+    return false;
+  }
+
+  map = (const unsigned char *)mapping;
+
+  // the file is read more or less front to back
+  madvise(mapping, map_size, MADV_SEQUENTIAL);
+
+  if( !parse_header((const char *)map + map_size) )
+  {
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+
+void Y4mReader::close()
+{
+  if( map != NULL )
+    munmap((void *)map, map_size);
+
+  map = NULL;
+  map_size = 0;
+  frame_offsets.clear();
+}
+
+
+namespace
+{
+  /** Parse the stream header line (without the newline) */
+  bool parse_stream_header(const char *pos, const char *line_end, const string &file_name,
+                           int &width, int &height, int &chroma_shift, char &interlacing)
+  {
+    if( line_end - pos < 10 || memcmp(pos, "YUV4MPEG2 ", 10) != 0 )
+    {
+      cerr << "Error: " << file_name << " is not a YUV4MPEG2 stream" << endl;
+      return false;
+    }
+
+    string chroma("420jpeg");   // the default if no C tag is given
+
+    // tags are space separated, a single letter followed by the value
+    for( pos += 10; pos < line_end; )
+    {
+      const char *tag_end = pos;
+      while( tag_end < line_end && *tag_end != ' ' )
+        ++tag_end;
+
+      string value(pos+1, tag_end);
+
+      switch(*pos)
+      {
+        case 'W': width  = atoi(value.c_str()); break;
+        case 'H': height = atoi(value.c_str()); break;
+        case 'I': interlacing = value.empty() ? 'p' : value[0]; break;
+        case 'C': chroma = value; break;
+        default: break;   // frame rate, aspect ratio and extensions aren't needed
+      }
+
+      pos = tag_end + 1;
+    }
+
+    if( chroma.compare(0, 3, "420") == 0 )
+      chroma_shift = 1;
+    else if( chroma == "444" )
+      chroma_shift = 0;
+    else
+    {
+      cerr << "Error: Unsupported chroma subsampling C" << chroma << " in " << file_name << endl;
+      return false;
+    }
+
+    if( width <= 0 || height <= 0 )
+    {
+      cerr << "Error: Bad frame size in " << file_name << endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  size_t frame_size(int width, int height, int chroma_shift)
+  {
+    int chroma_width  = (width  + chroma_shift) >> chroma_shift;
+    int chroma_height = (height + chroma_shift) >> chroma_shift;
+
+    return (size_t)width*height + 2*(size_t)chroma_width*chroma_height;
+  }
+
+  /** Views of the planes of a frame starting at data */
+  void plane_views(unsigned char *data, int width, int height, int chroma_shift, Mat &y, Mat &cb, Mat &cr)
+  {
+    int chroma_width  = (width  + chroma_shift) >> chroma_shift;
+    int chroma_height = (height + chroma_shift) >> chroma_shift;
+
+    unsigned char *cb_data = data + (size_t)width*height;
+    unsigned char *cr_data = cb_data + (size_t)chroma_width*chroma_height;
+
+    y  = Mat(height, width, CV_8UC1, data);
+    cb = Mat(chroma_height, chroma_width, CV_8UC1, cb_data);
+    cr = Mat(chroma_height, chroma_width, CV_8UC1, cr_data);
+  }
+}
+
+
+/** Parse the stream header and index the start of every frame's data */
+bool Y4mReader::parse_header(const char *end)
+{
+  const char *pos = (const char *)map;
+  const char *line_end = (const char *)memchr(pos, '\n', end - pos);
+
+  if( line_end == NULL )
+  {
+    cerr << "Error: " << file_name << " is not a YUV4MPEG2 stream" << endl;
+    return false;
+  }
+
+  if( !parse_stream_header(pos, line_end, file_name, width_, height_, chroma_shift_, interlacing) )
+    return false;
+
+  return index_frames(line_end + 1, end);
+}
+
+
+/** Find the start of every frame's data */
+bool Y4mReader::index_frames(const char *pos, const char *end)
+{
+  size_t frame_size = ::frame_size(width_, height_, chroma_shift_);
+  const char *line_end;
+
+  // each frame is "FRAME", optional parameters, a newline and then the raw planes
+  while( pos < end )
+  {
+    if( end - pos < 5 || memcmp(pos, "FRAME", 5) != 0 )
+    {
+      cerr << "Error: Bad frame header at offset " << (pos - (const char *)map) << " in " << file_name << endl;
+      return false;
+    }
+
+    line_end = (const char *)memchr(pos, '\n', end - pos);
+    if( line_end == NULL || (size_t)(end - line_end - 1) < frame_size )
+    {
+      cerr << "Warning: Ignoring truncated last frame in " << file_name << endl;
+      break;
+    }
+
+    frame_offsets.push_back(line_end + 1 - (const char *)map);
+    pos = line_end + 1 + frame_size;
+  }
+
+  if( frame_offsets.empty() )
+  {
+    cerr << "Error: No frames found in " << file_name << endl;
+    return false;
+  }
+
+  return true;
+}
+
+
+void Y4mReader::frame_planes(int frame, Mat &y, Mat &cb, Mat &cr) const
+{
+  plane_views((unsigned char *)map + frame_offsets[frame], width_, height_, chroma_shift_, y, cb, cr);
+}
+
+
+void Y4mReader::field_planes(int frame, int parity, Mat &y, Mat &cb, Mat &cr) const
+{
+  Mat frame_y, frame_cb, frame_cr;
+  frame_planes(frame, frame_y, frame_cb, frame_cr);
+
+  // In an interlaced 4:2:0 stream the chroma lines alternate between the fields in the same
+  // way the luma lines do, so both are split by taking every other line.
+  y  = field_lines(frame_y, parity);
+  cb = field_lines(frame_cb, parity);
+  cr = field_lines(frame_cr, parity);
+}
+
+
+Mat field_lines(const Mat &plane, int parity)
+{
+  // an even number of continuous lines can be seen as half as many lines twice as long, and the
+  // field is one half of each - a view that keeps a reference to the plane like any other
+  if( plane.isContinuous() && plane.rows % 2 == 0 )
+    return plane.reshape(0, plane.rows/2).colRange(parity*plane.cols, (parity+1)*plane.cols);
+
+  return Mat((plane.rows + 1 - parity)/2, plane.cols, plane.type(), (void *)plane.ptr(parity), plane.step*2);
+}
+
+
+
+Y4mStream::Y4mStream() :
+  fd(-1),
+  raw(false),
+  width_(0),
+  height_(0),
+  chroma_shift_(1),
+  interlacing('p'),
+  pending_pos(0)
+{
+}
+
+
+Y4mStream::~Y4mStream()
+{
+  close();
+}
+
+
+bool Y4mStream::open(const string &file_name)
+{
+  if( !open_file(file_name) )
+    return false;
+
+  string header;
+  if( !read_line(header) )
+  {
+    cerr << "Error: " << file_name << " is not a YUV4MPEG2 stream" << endl;
+    close();
+    return false;
+  }
+
+  if( !parse_stream_header(header.data(), header.data() + header.size(), file_name, width_, height_, chroma_shift_, interlacing) )
+  {
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+
+bool Y4mStream::open_raw(const string &file_name, int width, int height)
+{
+  if( width <= 0 || height <= 0 || width % 2 != 0 || height % 2 != 0 )
+  {
+    cerr << "Error: A raw 4:2:0 stream must have an even width and height, not " << width << 'x' << height << endl;
+    return false;
+  }
+
+  if( !open_file(file_name) )
+    return false;
+
+  raw = true;
+  width_ = width;
+  height_ = height;
+  chroma_shift_ = 1;
+  interlacing = 't';
+
+  return true;
+}
+
+
+/** Open the file, "-" for stdin, ready to read from the start */
+bool Y4mStream::open_file(const string &file_name)
+{
+  close();
+
+  this->file_name = file_name;
+  raw = false;
+
+  fd = file_name == "-" ? dup(STDIN_FILENO) : ::open(file_name.c_str(), O_RDONLY);
+  if( fd < 0 )
+  {
+    cerr << "Error: Failed opening " << file_name << endl;
+    return false;
+  }
+
+  return true;
+}
+
+
+void Y4mStream::close()
+{
+  if( fd >= 0 )
+    ::close(fd);
+
+  fd = -1;
+  pending.clear();
+  pending_pos = 0;
+}
+
+
+size_t Y4mStream::frame_bytes() const
+{
+  return frame_size(width_, height_, chroma_shift_);
+}
+
+
+bool Y4mStream::read_frame(Mat &buffer)
+{
+  assert( buffer.isContinuous() && buffer.total() * buffer.elemSize() >= frame_bytes() );
+
+  // "FRAME", optional parameters and a newline, then the raw planes - only the planes in a
+  // raw stream
+  if( !raw )
+  {
+    string frame_header;
+    if( !read_line(frame_header) )
+      return false;
+
+    if( frame_header.compare(0, 5, "FRAME") != 0 )
+    {
+      cerr << "Error: Bad frame header in " << file_name << endl;
+      return false;
+    }
+  }
+
+  unsigned char *data = buffer.data;
+  size_t bytes = frame_bytes();
+
+  // the end of a raw stream is only seen when the next frame doesn't start
+  if( raw )
+  {
+    if( !read_bytes(data, 1) )
+      return false;
+
+    ++data;
+    --bytes;
+  }
+
+  if( !read_bytes(data, bytes) )
+  {
+    cerr << "Warning: Ignoring truncated last frame in " << file_name << endl;
+    return false;
+  }
+
+  return true;
+}
+
+
+void Y4mStream::frame_planes(const Mat &buffer, Mat &y, Mat &cb, Mat &cr) const
+{
+  plane_views(buffer.data, width_, height_, chroma_shift_, y, cb, cr);
+}
+
+
+/** Read up to a newline, which is dropped */
+bool Y4mStream::read_line(string &line)
+{
+  line.clear();
+
+  for(;;)
+  {
+    if( pending_pos == pending.size() )
+    {
+      // headers are short, don't read far into the frame data
+      pending.resize(64);
+      pending_pos = 0;
+
+      ssize_t length;
+      do
+      {
+        length = ::read(fd, &pending[0], pending.size());
+      }
+      while( length < 0 && errno == EINTR );
+
+      if( length <= 0 )
+      {
+        pending.clear();
+        return false;
+      }
+
+      pending.resize(length);
+    }
+
+    char *start = &pending[pending_pos];
+    char *end = (char *)memchr(start, '\n', pending.size() - pending_pos);
+
+    if( end != NULL )
+    {
+      line.append(start, end);
+      pending_pos += end - start + 1;
+      return true;
+    }
+
+    line.append(start, pending.size() - pending_pos);
+    pending_pos = pending.size();
+  }
+}
+
+
+bool Y4mStream::read_bytes(unsigned char *data, size_t bytes)
+{
+  // anything read ahead with the header first
+  size_t buffered = min(bytes, pending.size() - pending_pos);
+  if( buffered > 0 )
+  {
+    memcpy(data, &pending[pending_pos], buffered);
+    pending_pos += buffered;
+    data += buffered;
+    bytes -= buffered;
+  }
+
+  while( bytes > 0 )
+  {
+    ssize_t length = ::read(fd, data, bytes);
+    if( length < 0 && errno == EINTR )
+      continue;
+
+    if( length <= 0 )
+      return false;
+
+    data += length;
+    bytes -= length;
+  }
+
+  return true;
+}
+
+
+
+namespace
+{
+  /** Fixed point (16 bit fraction) tables for the BT.601 studio range YCbCr to RGB conversion */
+  struct YCbCrTables
+  {
+    int y[256];
+    int cr_r[256], cr_g[256];
+    int cb_g[256], cb_b[256];
+
+    YCbCrTables()
+    {
+      for( int i=0; i<256; ++i )
+      {
+        y[i]    = cvRound( 1.164383 * (i-16)  * 65536 ) + 32768;   // + 0.5 for rounding
+        cr_r[i] = cvRound( 1.596027 * (i-128) * 65536 );
+        cr_g[i] = cvRound(-0.812968 * (i-128) * 65536 );
+        cb_g[i] = cvRound(-0.391762 * (i-128) * 65536 );
+        cb_b[i] = cvRound( 2.017232 * (i-128) * 65536 );
+      }
+    }
+  };
+
+  inline uchar clamp_fixed(int value)
+  {
+    value >>= 16;
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+  }
+
+  const YCbCrTables &ycbcr_tables()
+  {
+    static const YCbCrTables tables;
+    return tables;
+  }
+}
+
+
+void ycbcr_to_bgr_pixel(uchar y, uchar cb, uchar cr, uchar *bgr)
+{
+  const YCbCrTables &tables = ycbcr_tables();
+
+  int luma = tables.y[y];
+
+  bgr[0] = clamp_fixed( luma + tables.cb_b[cb] );
+  bgr[1] = clamp_fixed( luma + tables.cb_g[cb] + tables.cr_g[cr] );
+  bgr[2] = clamp_fixed( luma + tables.cr_r[cr] );
+}
+
+
+void ycbcr_to_bgr(const Mat &y, const Mat &cb, const Mat &cr, Mat &bgr)
+{
+  const YCbCrTables &tables = ycbcr_tables();
+
+  // work out the subsampling from the plane sizes
+  int shift = (cb.cols < y.cols) ? 1 : 0;
+
+  bgr.create(y.rows, y.cols, CV_8UC3);
+
+  for( int row=0; row < y.rows; ++row )
+  {
+    const uchar *y_ptr  = y.ptr(row);
+    const uchar *cb_ptr = cb.ptr(row >> shift);
+    const uchar *cr_ptr = cr.ptr(row >> shift);
+
+    uchar *bgr_ptr = bgr.ptr(row);
+
+    for( int col=0; col < y.cols; ++col )
+    {
+      int luma = tables.y[ y_ptr[col] ];
+      int blue_diff = cb_ptr[col >> shift];
+      int red_diff  = cr_ptr[col >> shift];
+
+      bgr_ptr[0] = clamp_fixed( luma + tables.cb_b[blue_diff] );
+      bgr_ptr[1] = clamp_fixed( luma + tables.cb_g[blue_diff] + tables.cr_g[red_diff] );
+      bgr_ptr[2] = clamp_fixed( luma + tables.cr_r[red_diff] );
+
+      bgr_ptr += 3;
+    }
+  }
+}
@@ -0,0 +1,144 @@
+#ifndef Y4MREADER_H
+#define Y4MREADER_H
+
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+/**
+ * Reads a YUV4MPEG2 stream (e.g. the stream.yuv written by mplayer -vo yuv4mpeg) straight
+ * from a memory mapping of the file. The frame headers are indexed once when the file is
+ * opened, after that each frame or field is handed out as Mat headers pointing into the
+ * mapping so no image data is copied or allocated. The mapping is read only - don't draw on
+ * the planes.
+ */
+class Y4mReader
+{
+  public:
+    Y4mReader();
+    ~Y4mReader();
+
+    bool open(const std::string &file_name);
+    void close();
+
+    bool is_open() const { return map != NULL; }
+
+    int frame_count() const { return frame_offsets.size(); }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+    // chroma subsampling shift, 1 for 4:2:0 and 0 for 4:4:4
+    int chroma_shift() const { return chroma_shift_; }
+
+    // true if the stream header says the bottom field comes first in time
+    bool bottom_field_first() const { return interlacing == 'b'; }
+
+    /** Get views of the Y, Cb and Cr planes of a full frame */
+    void frame_planes(int frame, cv::Mat &y, cv::Mat &cb, cv::Mat &cr) const;
+
+    /**
+     * Get views of the planes of one field of an interlaced frame, parity 0 is the top field
+     * (even lines) and 1 is the bottom field. These are strided views, every other line of the
+     * frame's planes.
+     */
+    void field_planes(int frame, int parity, cv::Mat &y, cv::Mat &cb, cv::Mat &cr) const;
+
+  private:
+    bool parse_header(const char *end);
+    bool index_frames(const char *pos, const char *end);
+
+    std::string file_name;
+
+    const unsigned char *map;
+    size_t map_size;
+
+    int width_;
+    int height_;
+    int chroma_shift_;
+    char interlacing;   // y4m 'I' tag - p(rogressive), t(op first), b(ottom first) or m(ixed)
+
+    std::vector<size_t> frame_offsets;   // offset of each frame's data in the mapping
+};
+
+
+/**
+ * Reads a YUV4MPEG2 stream as it arrives from a pipe, FIFO or stdin (e.g. mplayer -vo yuv4mpeg
+ * writing to a FIFO), rather than from a complete file. Each frame is read into a buffer given
+ * by the caller so frames can be kept while the next ones are read. Headerless raw 4:2:0 frames
+ * (e.g. ffmpeg -f rawvideo -pix_fmt yuv420p) can be read too, the size has to be given instead.
+ */
+class Y4mStream
+{
+  public:
+    Y4mStream();
+    ~Y4mStream();
+
+    /** Open the stream, "-" for stdin, and read its header - this waits for the writer */
+    bool open(const std::string &file_name);
+
+    /**
+     * Open a stream of raw 4:2:0 frames with no headers, each the Y plane then the Cb and Cr
+     * planes at half the size. Interlaced frames are taken to be top field first.
+     */
+    bool open_raw(const std::string &file_name, int width, int height);
+
+    void close();
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int chroma_shift() const { return chroma_shift_; }
+    bool bottom_field_first() const { return interlacing == 'b'; }
+
+    /** Bytes of image data in each frame */
+    size_t frame_bytes() const;
+
+    /**
+     * Read the next frame into buffer, a continuous 8 bit image of at least frame_bytes().
+     * False at the end of the stream.
+     */
+    bool read_frame(cv::Mat &buffer);
+
+    /** Get views of the Y, Cb and Cr planes of a frame read into buffer, which must be kept */
+    void frame_planes(const cv::Mat &buffer, cv::Mat &y, cv::Mat &cb, cv::Mat &cr) const;
+
+  private:
+    bool open_file(const std::string &file_name);
+    bool read_line(std::string &line);
+    bool read_bytes(unsigned char *data, size_t bytes);
+
+    std::string file_name;
+    int fd;
+    bool raw;   // no stream or frame headers
+
+    int width_;
+    int height_;
+    int chroma_shift_;
+    char interlacing;
+
+    // read ahead while looking for the end of a header line
+    std::vector<char> pending;
+    size_t pending_pos;
+};
+
+
+/**
+ * Get a view of one field of an interlaced plane - every other line starting from parity, 0
+ * for the top field and 1 for the bottom. Nothing is copied, the view keeps a reference to the
+ * plane's data if it has an even number of continuous lines.
+ */
+cv::Mat field_lines(const cv::Mat &plane, int parity);
+
+
+/**
+ * Convert planar YCbCr (ITU-R BT.601, studio range as written by mplayer) to a BGR image.
+ * The chroma planes may be subsampled by 2 in each direction, they are upsampled by pixel
+ * replication which is the same as the box filter y4mscaler was previously used with.
+ */
+void ycbcr_to_bgr(const cv::Mat &y, const cv::Mat &cb, const cv::Mat &cr, cv::Mat &bgr);
+
+/** Convert a single YCbCr pixel to BGR, exactly as ycbcr_to_bgr would */
+void ycbcr_to_bgr_pixel(unsigned char y, unsigned char cb, unsigned char cr, unsigned char *bgr);
+
+#endif // Y4MREADER_H